@@ -1,32 +1,48 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+
 #include "FreeRTOS.h"
 #include "stdio.h"
 
 #include "ArduinoJson.hpp"
 
+/**
+ * @struct  FreeRTOSAllocator
+ * @brief   ArduinoJson allocator over the FreeRTOS heap.
+ * @note    every block is preceded by its size, so reallocate() only copies
+ *          the bytes the old block actually had.
+ */
 struct FreeRTOSAllocator : ArduinoJson::Allocator {
+    static constexpr size_t HEADER = 8; // keeps the 8 bytes alignment of pvPortMalloc
+
     void *allocate(size_t size) override {
-        return pvPortMalloc(size);
+        uint8_t *block = static_cast<uint8_t *>(pvPortMalloc(HEADER + size));
+        if (block == NULL) {
+            return NULL;
+        }
+        *reinterpret_cast<size_t *>(block) = size;
+        return block + HEADER;
     }
 
     void deallocate(void *pointer) override {
-        vPortFree(pointer);
+        if (pointer != NULL) {
+            vPortFree(static_cast<uint8_t *>(pointer) - HEADER);
+        }
     }
 
     void *reallocate(void *ptr, size_t new_size) override {
         if (new_size == 0) {
-            vPortFree(ptr);
+            deallocate(ptr);
             return NULL;
         }
 
-        void *new_ptr;
-        new_ptr = pvPortMalloc(new_size);
-        if (new_ptr) {
-            if (ptr != NULL) {
-                memcpy(new_ptr, ptr, new_size);
-                vPortFree(ptr);
-            }
+        void *new_ptr = allocate(new_size);
+        if (new_ptr && ptr != NULL) {
+            size_t old_size = *reinterpret_cast<size_t *>(static_cast<uint8_t *>(ptr) - HEADER);
+            memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+            deallocate(ptr);
         }
         return new_ptr;
     }
@@ -35,11 +51,116 @@ struct FreeRTOSAllocator : ArduinoJson::Allocator {
     virtual ~FreeRTOSAllocator() = default;
 };
 
+/**
+ * @class   ArenaAllocator
+ * @brief   bump allocator over a fixed buffer, for documents that all die
+ *          together. reset() gives the whole buffer back at once.
+ * @note    deallocate() only reclaims the last block, reallocate() grows or
+ *          shrinks the last block in place. Requests that don't fit go to the
+ *          FreeRTOS heap and are counted as overflows.
+ */
+class ArenaAllocator : public ArduinoJson::Allocator {
+  public:
+    static constexpr size_t HEADER = 8;
+
+    ArenaAllocator(void *buffer, size_t capacity) : buffer(static_cast<uint8_t *>(buffer)), capacity(capacity) {
+    }
+
+    void *allocate(size_t size) override {
+        size_t needed = HEADER + align(size);
+        if (top + needed > capacity) {
+            overflows++;
+            return heap.allocate(size);
+        }
+        uint8_t *block = buffer + top;
+        *reinterpret_cast<size_t *>(block) = size;
+        last = top;
+        top += needed;
+        if (top > high_water) {
+            high_water = top;
+        }
+        return block + HEADER;
+    }
+
+    void deallocate(void *pointer) override {
+        if (pointer == NULL) {
+            return;
+        }
+        if (!owns(pointer)) {
+            heap.deallocate(pointer);
+        } else if (static_cast<uint8_t *>(pointer) - HEADER == buffer + last) {
+            top = last;
+        }
+    }
+
+    void *reallocate(void *ptr, size_t new_size) override {
+        if (ptr == NULL) {
+            return allocate(new_size);
+        }
+        if (new_size == 0) {
+            deallocate(ptr);
+            return NULL;
+        }
+        if (!owns(ptr)) {
+            return heap.reallocate(ptr, new_size);
+        }
+
+        uint8_t *block = static_cast<uint8_t *>(ptr) - HEADER;
+        size_t old_size = *reinterpret_cast<size_t *>(block);
+        if (block == buffer + last && last + HEADER + align(new_size) <= capacity) {
+            *reinterpret_cast<size_t *>(block) = new_size;
+            top = last + HEADER + align(new_size);
+            if (top > high_water) {
+                high_water = top;
+            }
+            return ptr;
+        }
+
+        void *new_ptr = allocate(new_size);
+        if (new_ptr) {
+            memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        }
+        return new_ptr;
+    }
+
+    /**
+     * @brief   forgets every block, documents using the arena must be gone
+     */
+    void reset() {
+        top = 0;
+        last = 0;
+    }
+
+    size_t used() const {
+        return top;
+    }
+
+    size_t high_water = 0;
+    uint32_t overflows = 0;
+
+  private:
+    static size_t align(size_t size) {
+        return (size + HEADER - 1) & ~(HEADER - 1);
+    }
+
+    bool owns(void *pointer) const {
+        return pointer >= buffer && pointer < buffer + capacity;
+    }
+
+    uint8_t *buffer;
+    size_t capacity;
+    size_t top = 0;
+    size_t last = 0;
+    FreeRTOSAllocator heap;
+};
+
 namespace ArduinoJson {
     class MyJsonDocument : public ArduinoJson::JsonDocument {
       public:
         MyJsonDocument() : ArduinoJson::JsonDocument(&allocator){};
 
+        explicit MyJsonDocument(Allocator *allocator) : ArduinoJson::JsonDocument(allocator){};
+
       private:
         static FreeRTOSAllocator allocator;
     };
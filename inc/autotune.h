@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "bresenham.h"
+
+#define AUTOTUNE_TASK_PRIORITY    (configMAX_PRIORITIES - 3)
+#define AUTOTUNE_SAMPLE_PERIOD_MS 5
+#define AUTOTUNE_MOVE_TIMEOUT_MS  10000
+#define AUTOTUNE_HOLD_MS          100
+
+/**
+ * @struct  autotune_trial
+ * @brief   step response measured for one gain / max output combination.
+ */
+struct autotune_trial {
+    float gain;
+    int max_freq;
+    int rise_ms;     //!< 10% to 90% of the step
+    int settling_ms; //!< until the position stays inside the settling band
+    int overshoot;   //!< counts beyond the target
+    bool stalled;
+    bool settled;
+};
+
+/**
+ * @class   autotune
+ * @brief   runs step response experiments on one axes group to propose kp_ and
+ *          output limits.
+ * @note    the experiment moves the first axis of the group forward and back
+ *          by the requested distance once per trial. Telemetry must stay
+ *          connected to keep the watchdog from stopping the moves.
+ */
+class autotune {
+  public:
+    static const int MAX_TRIALS = 8;
+
+    static bool start(
+        bresenham *axes,
+        int distance_counts,
+        const float *gains,
+        int gains_count,
+        const int *max_freqs,
+        int max_freqs_count,
+        int max_overshoot,
+        bool apply);
+
+    static volatile bool running;
+    static bresenham *axes;
+    static autotune_trial trials[MAX_TRIALS];
+    static int trials_count;
+    static int best;
+    static bool applied;
+    static int proposed_normal_min;
+    static int proposed_normal_max;
+    static int proposed_slow_min;
+    static int proposed_slow_max;
+
+  private:
+    static void task(void *pars);
+
+    static void run_trial(autotune_trial &trial, int origin);
+
+    static bool wait_until_stopped(int timeout_ms);
+
+    static int distance_counts;
+    static int max_overshoot;
+    static bool apply;
+};
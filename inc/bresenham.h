@@ -10,6 +10,7 @@
 #include "kp.h"
 #include "mot_pap.h"
 #include "semphr.h"
+#include "supervisor_timebase.h"
 #include "task.h"
 #include "tmr.h"
 
@@ -25,34 +26,45 @@ struct bresenham_msg {
     enum mot_pap::speed speed = mot_pap::speed::NORMAL;
     int first_axis_setpoint;
     int second_axis_setpoint;
+    uint32_t request_id = 0; //!< completion or failure is posted to events, 0 for none
 };
 
 class bresenham {
   public:
+    /**
+     * @brief   supervisor checks, notified as bits by the supervisor timebase
+     */
+    enum supervisor_check : uint32_t {
+        PROBE_CHECK = 1 << 0,
+        STALL_CHECK = 1 << 1,
+        CONTROL_UPDATE = 1 << 2,
+        WATCHDOG_CHECK = 1 << 3,
+        TARGET_REACHED = 1 << 4, //!< notified by the step ISR
+    };
+
     bresenham() = delete;
 
     explicit bresenham(const char *name, mot_pap *first_axis, mot_pap *second_axis, class tmr t, bool has_brakes = false)
         : name(name), first_axis(first_axis), second_axis(second_axis), tmr(t), has_brakes(has_brakes) {
 
         queue = xQueueCreate(5, sizeof(struct bresenham_msg *));
-        supervisor_semaphore = xSemaphoreCreateBinary();
+        move_request_done = xSemaphoreCreateBinary();
 
         char supervisor_task_name[configMAX_TASK_NAME_LEN];
         memset(supervisor_task_name, 0, sizeof(supervisor_task_name));
         strncat(supervisor_task_name, name, sizeof(supervisor_task_name) - strlen(supervisor_task_name) - 1);
         strncat(supervisor_task_name, "_supervisor", sizeof(supervisor_task_name) - strlen(supervisor_task_name) - 1);
-        if (supervisor_semaphore != NULL) {
-            // Create the 'handler' task, which is the task to which interrupt
-            // processing is deferred
-            xTaskCreate(
-                [](void *axes) { static_cast<bresenham *>(axes)->supervise(); },
-                supervisor_task_name,
-                256,
-                this,
-                SUPERVISOR_TASK_PRIORITY,
-                &supervisor_task_handle);
-            lDebug(Info, "%s: created", supervisor_task_name);
-        }
+        // Create the 'handler' task, which is the task to which the timebase
+        // and step interrupts processing is deferred
+        xTaskCreate(
+            [](void *axes) { static_cast<bresenham *>(axes)->supervise(); },
+            supervisor_task_name,
+            256,
+            this,
+            SUPERVISOR_TASK_PRIORITY,
+            &supervisor_task_handle);
+        lDebug(Info, "%s: created", supervisor_task_name);
+        supervisor_timebase::add(this);
 
         char task_name[configMAX_TASK_NAME_LEN];
         memset(task_name, 0, sizeof(task_name));
@@ -79,20 +91,19 @@ class bresenham {
 
     void isr();
 
-    void stop();
-
-    void pause();
+    void stop(const char *cause = nullptr);
 
-    void resume();
+    void start_step_timer();
 
   public:
     const char *name;
     volatile bool is_moving = false;
     volatile int current_freq = 0;
-    std::chrono::milliseconds step_time = std::chrono::milliseconds(100);
-    TickType_t ticks_last_time = 0;
+    std::chrono::milliseconds step_time = std::chrono::milliseconds(100); // control update period
+    std::chrono::milliseconds probe_check_period = std::chrono::milliseconds(2);
+    std::chrono::milliseconds stall_check_period = std::chrono::milliseconds(5);
+    std::chrono::milliseconds watchdog_check_period = std::chrono::milliseconds(100);
     QueueHandle_t queue;
-    SemaphoreHandle_t supervisor_semaphore;
     TaskHandle_t supervisor_task_handle = nullptr;
     mot_pap *first_axis = nullptr;
     mot_pap *second_axis = nullptr;
@@ -103,14 +114,25 @@ class bresenham {
     volatile bool was_stopped_by_probe = false;
     volatile bool was_stopped_by_probe_protection = false;
     volatile int touching_counter = 0;
-    int touching_max_count = 3;
+    // Consecutive probe checks touching before the protection stops the axes,
+    // 300 ms at the default 2 ms probe_check_period (it was 3 checks of 100 ms)
+    int touching_max_count = 150;
     bool has_brakes = false;
+    volatile bool start_pending = false; //!< planned move waiting for the brakes to release
     class kp kp;
     volatile int error;
     volatile enum mot_pap::speed speed = mot_pap::speed::NORMAL;
+    encoders_pico::request move_request;    //!< targets and directions, sent while the move is planned
+    SemaphoreHandle_t move_request_done;
+    uint32_t move_start_cycles = 0;             //!< DWT->CYCCNT when the last move was requested
+    volatile uint32_t move_latency_cycles = 0;  //!< from the move request to the step timer being armed
+    volatile uint32_t move_latency_max_cycles = 0;
+    volatile uint32_t request_id = 0;           //!< of the move in progress, 0 for none
 
   private:
-    void calculate();
+    void calculate(encoders_pico::transaction *t = nullptr);
+
+    void finish_request(const char *failure);
 
     bresenham(bresenham const &) = delete;
     void operator=(bresenham const &) = delete;
@@ -11,20 +11,74 @@
 #include "debug.h"
 #include "gpio.h"
 #include "gpio_templ.h"
+#include "pico_emulator.h"
 #include "quadrature_encoder_constants.h"
+#include "seqlock.h"
 #include "spi.h"
+#include "spi_stats.h"
 
-#define ENCODERS_PICO_TASK_PRIORITY (configMAX_PRIORITIES - 1)
+#define ENCODERS_PICO_TASK_PRIORITY          (configMAX_PRIORITIES - 1)
+#define ENCODERS_PICO_SAMPLING_TASK_PRIORITY (configMAX_PRIORITIES - 1)
+#define ENCODERS_PICO_SAMPLING_PERIOD_MS     2
+#define ENCODERS_PICO_COUNTERS               4
+#define ENCODERS_PICO_FRAME_RETRIES          3
+#define ENCODERS_PICO_QUEUE_LENGTH           8  // per priority class
+#define ENCODERS_PICO_REQUEST_TIMEOUT_MS     20
+#define ENCODERS_PICO_SAFETY_WAIT_MS         2  // bounded wait for the lane of each priority class
+#define ENCODERS_PICO_MOTION_WAIT_MS         10
+#define ENCODERS_PICO_TELEMETRY_WAIT_MS      50
+
+#define ENCODERS_PICO_CALIBRATION_TRANSFERS  64
+#define ENCODERS_PICO_CALIBRATION_MARGIN     80 // % of the highest error free bitrate, the guard time gets the inverse
+#define ENCODERS_PICO_CALIBRATION_REGISTERS  4  // read back, nothing writes them at runtime
 #define ENCODERS_PICO_INTERRUPT_PRIORITY                                                                                    \
     (configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY + 1) // Has to have higher priority than timers ( now +2 )
 
 inline SemaphoreHandle_t encoders_pico_semaphore;
 
+#ifdef SIMULATE_ENCODER
+inline pico_emulator encoders_emulator; // Replaces the board behind the encoders_pico transport
+#endif
+
 struct limits {
     uint8_t hard;
     uint8_t targets;
 };
 
+/**
+ * @struct  encoders_snapshot
+ * @brief   counters and limits read together by the sampling task.
+ */
+struct encoders_snapshot {
+    int32_t counters[ENCODERS_PICO_COUNTERS]; //!< X, Y, Z, W, not reversed
+    struct limits limits;
+    TickType_t ticks;                         //!< when the counters were read
+    uint32_t cycles;                          //!< DWT->CYCCNT when the counters were read
+};
+
+/**
+ * @struct  encoders_link_stats
+ * @brief   integrity errors seen on framed transactions.
+ */
+struct encoders_link_stats {
+    uint32_t frames;
+    uint32_t crc_errors; //!< response CRC mismatch
+    uint32_t seq_errors; //!< PICO didn't echo the sequence, it rejected the request CRC
+    uint32_t retries;
+    uint32_t failures;   //!< transactions given up after all the retries
+};
+
+/**
+ * @struct  encoders_bus_stats
+ * @brief   arbitration outcomes of one priority class.
+ */
+struct encoders_bus_stats {
+    uint32_t requests;
+    uint32_t lane_timeouts; //!< blocking callers that gave up waiting for their lane
+    uint32_t preempted;     //!< queued requests dropped to make room for a higher class
+    uint32_t rejected;      //!< requests that found the queues full
+};
+
 /**
  * @brief   handles the CS line for the ENCODERS RASPBERRY PI PICO
  * @param   state    : boolean value for the output
@@ -47,6 +101,121 @@ static void cs_function(bool state) {
 class encoders_pico {
 
   public:
+    /**
+     * @brief   bus arbitration classes, lower values are served first. Queued
+     *          requests of a lower class are preempted when a higher one finds
+     *          its queue full, the active frame is always let finish.
+     */
+    enum priority {
+        SAFETY,    //!< limits IRQ handling
+        MOTION,    //!< targets, directions, sampling for the supervisors
+        TELEMETRY, //!< diagnostics, calibration, commands
+        PRIORITIES_COUNT
+    };
+
+    static constexpr const char *priority_names[PRIORITIES_COUNT] = { "safety", "motion", "telemetry" };
+
+    /**
+     * @class   transaction
+     * @brief   several register accesses packed into one CS frame. Every
+     *          operation takes 5 bytes: the address (with WRITE_MASK for
+     *          writes) followed by the 4 data bytes, which the PICO answers in
+     *          place for reads.
+     * @note    framed transactions are preceded by a sequence byte and followed
+     *          by the request CRC-8 and two more bytes, where the PICO answers
+     *          with the echoed sequence and the CRC-8 of its response. Without
+     *          the framed or batched capabilities the operations go one by one
+     *          as an address frame and a data frame.
+     */
+    class transaction {
+      public:
+        static const int MAX_OPS = 8;
+        static const int OP_SIZE = 5;
+        static const int FRAME_HEADER = 1;  // sequence
+        static const int FRAME_TRAILER = 3; // request CRC, echoed sequence, response CRC
+
+        transaction &write(uint8_t address, int32_t data) {
+            if (uint8_t *op = append(address | quadrature_encoder_constants::WRITE_MASK, nullptr)) {
+                op[1] = static_cast<uint8_t>((data >> 24) & 0xFF);
+                op[2] = static_cast<uint8_t>((data >> 16) & 0xFF);
+                op[3] = static_cast<uint8_t>((data >> 8) & 0xFF);
+                op[4] = static_cast<uint8_t>((data >> 0) & 0xFF);
+            }
+            return *this;
+        }
+
+        transaction &read(uint8_t address, int32_t *dest) {
+            append(address, dest);
+            return *this;
+        }
+
+        bool empty() const {
+            return ops == 0;
+        }
+
+        void clear() {
+            ops = 0;
+        }
+
+      private:
+        uint8_t *append(uint8_t address, int32_t *dest) {
+            if (ops >= MAX_OPS) {
+                lDebug(Error, "Encoders transaction full, register 0x%x dropped", address);
+                return nullptr;
+            }
+            uint8_t *op = &tx[FRAME_HEADER + ops * OP_SIZE];
+            op[0] = address;
+            op[1] = op[2] = op[3] = op[4] = 0;
+            dests[ops++] = dest;
+            return op;
+        }
+
+        int ops_length() const {
+            return ops * OP_SIZE;
+        }
+
+        uint8_t tx[FRAME_HEADER + MAX_OPS * OP_SIZE + FRAME_TRAILER];
+        uint8_t rx[FRAME_HEADER + MAX_OPS * OP_SIZE + FRAME_TRAILER];
+        int32_t *dests[MAX_OPS];
+        int ops = 0;
+
+        friend class encoders_pico;
+    };
+
+    /**
+     * @struct  request
+     * @brief   queued bus access of up to two CS frames, processed one after
+     *          the other from the DMA interrupt.
+     * @note    done is called from the DMA ISR, it must only use FromISR APIs.
+     *          The request must stay alive until then.
+     */
+    struct request {
+        struct frame {
+            const uint8_t *tx; //!< dummy bytes if nullptr
+            uint8_t *rx;       //!< discarded if nullptr
+            uint16_t length;
+        };
+
+        transaction t; //!< operations, also the storage of the frames
+        frame frames[2];
+        int frames_count = 0;
+        bool framed = false; //!< check the sequence and CRC, retrying on mismatch
+        bool split = false;  //!< address and data frames per operation instead of frames[]
+        enum priority priority = MOTION;
+        void (*done)(request *r, BaseType_t *xHigherPriorityTaskWoken) = nullptr;
+        void *ctx = nullptr;
+        volatile int32_t status = 0; //!< 0 on success, -1 if the framed retries were exhausted, -2 if preempted
+        volatile bool completed = false;
+        uint32_t started = 0;  //!< DWT->CYCCNT when the first frame started
+        uint32_t finished = 0; //!< DWT->CYCCNT when the last frame completed
+
+      private:
+        int frame_index = 0;
+        int attempt = 0;
+
+        friend class encoders_pico;
+    };
+
     encoders_pico() {
         Chip_SCU_PinMuxSet(
             6,
@@ -56,6 +225,16 @@ class encoders_pico {
         Chip_GPIO_SetPinDIROutput(LPC_GPIO_PORT, 5, 15);
         Chip_GPIO_SetPinOutHigh(LPC_GPIO_PORT, 5, 15);
         spi_init();
+        for (int i = 0; i < PRIORITIES_COUNT; i++) {
+            lanes[i] = xSemaphoreCreateMutex();
+            blocking_done[i] = xSemaphoreCreateBinary();
+        }
+        sampling_lock = xSemaphoreCreateMutex();
+        spi_dma_done_hook = encoders_pico::dma_done_isr;
+#ifdef SIMULATE_ENCODER
+        cs = [](bool) {};
+        frame_start = encoders_pico::emulator_frame_start;
+#endif
 
         encoders_pico_semaphore = xSemaphoreCreateBinary();
 
@@ -65,30 +244,81 @@ class encoders_pico {
             xTaskCreate(encoders_pico::task, "encoders_pico", 256, NULL, ENCODERS_PICO_TASK_PRIORITY, NULL);
             lDebug(Info, "encoders_pico_task created");
         }
+
     }
 
     ~encoders_pico() {
+        spi_dma_done_hook = nullptr;
+        for (int i = 0; i < PRIORITIES_COUNT; i++) {
+            vSemaphoreDelete(lanes[i]);
+            vSemaphoreDelete(blocking_done[i]);
+        }
+        vSemaphoreDelete(sampling_lock);
         spi_de_init();
     }
 
     static void task(void *pars);
 
-    int32_t read_register(uint8_t address) const;
+    static void sampling_task(void *pars);
+
+    bool calibrate_bus();
 
-    void read_4_registers(uint8_t address, uint8_t *rx) const;
+    bool sample();
 
-    int32_t write_register(uint8_t address, int32_t data) const;
+    void publish_limits(struct limits limits);
+
+    /**
+     * @brief   latest counters and limits, without touching the SPI bus
+     */
+    struct encoders_snapshot snapshot() const {
+        return snapshot_lock.read();
+    }
+
+    int32_t read_register(uint8_t address,
+                          enum priority priority = MOTION,
+                          spi_stats::call_site site = spi_stats::READ_REGISTER,
+                          int32_t *status = nullptr) const;
+
+    void read_4_registers(uint8_t address, uint8_t *rx, enum priority priority = MOTION) const;
+
+    int32_t write_register(uint8_t address, int32_t data, enum priority priority = MOTION) const;
 
     struct limits read_limits() const;
 
-    struct limits read_limits_and_ack() const;
+    int32_t read_limits_and_ack(struct limits &limits) const;
+
+    int32_t execute(
+        transaction &t, spi_stats::call_site site = spi_stats::TRANSACTION, enum priority priority = MOTION) const;
 
-    void set_target(char axis, int target) {
-        write_register(quadrature_encoder_constants::TARGETS + (axis - 'X') + 1, target);
+    void prepare(request &r) const;
+
+    bool submit(request &r) const;
+
+    bool cancel(request &r) const;
+
+    void withdraw(request &r, SemaphoreHandle_t done) const;
+
+    /**
+     * @brief   clears the framing error counters, the DMA ISR updates them
+     */
+    void reset_link_stats() const {
+        taskENTER_CRITICAL();
+        link_stats = {};
+        taskEXIT_CRITICAL();
+    }
+
+    void set_target(char axis, int target, transaction *t = nullptr) {
+        uint8_t address = quadrature_encoder_constants::TARGETS + (axis - 'X') + 1;
+        if (t) {
+            t->write(address, target);
+        } else {
+            write_register(address, target);
+        }
     }
 
     void set_counter(char axis, int32_t data) {
         write_register(quadrature_encoder_constants::COUNTERS + (axis - 'X') + 1, data);
+        sample(); // Readers must not see the old counter after this returns
     }
 
     int read_counter(char axis) {
@@ -103,12 +333,76 @@ class encoders_pico {
         write_register(quadrature_encoder_constants::POS_THRESHOLDS, threshold);
     }
 
-    void set_direction(char axis, bool dir) {
-        write_register(quadrature_encoder_constants::DIRECTIONS + (axis - 'X') + 1, dir);
+    void set_direction(char axis, bool dir, transaction *t = nullptr) {
+        uint8_t address = quadrature_encoder_constants::DIRECTIONS + (axis - 'X') + 1;
+        if (t) {
+            t->write(address, dir);
+        } else {
+            write_register(address, dir);
+        }
     }
 
   public:
     void (*cs)(bool) = cs_function; ///< pointer to CS line function handler
+    void (*frame_start)(const uint8_t *tx, uint8_t *rx, uint16_t len) = spi_frame_start; ///< transport, completion
+                                                                                          ///< goes to dma_done_isr()
+    int sampling_period_ms = ENCODERS_PICO_SAMPLING_PERIOD_MS;
+    bool framed = false;  //!< sequence and CRC checked transactions, PICO firmware must support them
+    bool batched = false; //!< unframed transactions in a single CS frame, PICO firmware must support them
+    mutable struct encoders_link_stats link_stats = {};
+    mutable struct encoders_bus_stats bus_stats[PRIORITIES_COUNT] = {};
+    uint32_t max_good_bitrate = 0; //!< highest bitrate without errors found by calibration
+    int min_good_guard_us = SSP_DEFAULT_GUARD_US;
+    uint32_t sample_failures = 0; //!< samples whose read failed, readers kept the previous snapshot
+
+  private:
+    int readback_errors(const int32_t *reference, int transfers);
+
+    void prepare_write(request &r, uint8_t address, int32_t data) const;
+
+    void prepare_read(request &r, uint8_t address, int len) const;
+
+    int32_t run(request &r, spi_stats::call_site site, enum priority priority) const;
+
+    bool lane_take(enum priority priority) const;
+
+    void lane_give(enum priority priority) const;
+
+    bool enqueue(request &r, request **preempted) const;
+
+    request *dequeue() const;
+
+    int32_t run_polled(request &r) const;
+
+    void seal(request &r) const;
+
+    bool check(request &r) const;
+
+    void drop_acks(request &r) const;
+
+    request::frame frame_at(request &r, int index) const;
+
+    void start_frame() const;
+
+    static void dma_done_isr(BaseType_t *xHigherPriorityTaskWoken);
+
+#ifdef SIMULATE_ENCODER
+    static void emulator_frame_start(const uint8_t *tx, uint8_t *rx, uint16_t len);
+
+    static void emulator_frame_done(void *pars, uint32_t frame_id);
+
+    static inline uint32_t emulator_frame_id = 0; //!< completions of frames stopped by withdraw() are dropped
+#endif
+
+    mutable uint8_t frame_seq = 0;
+    mutable request *active = nullptr;
+    mutable request *pending[PRIORITIES_COUNT][ENCODERS_PICO_QUEUE_LENGTH];
+    mutable int pending_head[PRIORITIES_COUNT] = {};
+    mutable int pending_count[PRIORITIES_COUNT] = {};
+    SemaphoreHandle_t lanes[PRIORITIES_COUNT];         //!< blocking callers of the same class take turns
+    SemaphoreHandle_t blocking_done[PRIORITIES_COUNT]; //!< completes the request of the lane owner
+    SemaphoreHandle_t sampling_lock;                   //!< held by calibrate_bus() to pause sampling
+    seqlock<struct encoders_snapshot> snapshot_lock;
 };
 
 inline encoders_pico *encoders = nullptr;
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "queue.h"
+
+#define EVENTS_QUEUE_SIZE 16
+
+/**
+ * @struct  event
+ * @brief   completion or failure of a long running action started by a
+ *          command carrying a request id.
+ */
+struct event {
+    uint32_t id;         //!< request id given by the client
+    const char *source;  //!< axes group name, "brakes" or "touch_probe"
+    const char *failure; //!< nullptr if the action completed
+    uint32_t millis;     //!< supervisor_timebase::millis() when it ended
+    uint32_t cycles;     //!< DWT->CYCCNT when it ended, same clock as the scope samples
+};
+
+/**
+ * @class   events
+ * @brief   queue of the completions and failures waiting to be pushed to the
+ *          command client that owns motion control.
+ * @note    post() is callable from tasks and ISRs, the timestamp is taken
+ *          right there so it doesn't depend on when the queue is drained.
+ */
+class events {
+  public:
+    static void init();
+
+    static bool post(uint32_t id, const char *source, const char *failure = nullptr);
+
+    static bool receive(struct event &e);
+
+    static bool pending();
+
+    static volatile uint32_t dropped; //!< queue full, the client will have to poll
+
+  private:
+    static QueueHandle_t queue;
+};
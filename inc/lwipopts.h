@@ -134,9 +134,9 @@
 #define MEM_LIBC_MALLOC 0
 #define MEMP_MEM_MALLOC 1
 
-#define MEMP_NUM_TCP_PCB   6
+#define MEMP_NUM_TCP_PCB   12 // 4 servers plus up to TCP_SERVER_COMMAND_MAX_CLIENTS command clients
 #define MEMP_NUM_NETBUF    6
-#define MEMP_NUM_NETCONN   6
+#define MEMP_NUM_NETCONN   12
 
 
 /* Needed for malloc/free */
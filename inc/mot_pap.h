@@ -7,6 +7,7 @@
 #include "encoders_pico.h"
 #include "gpio.h"
 #include "semphr.h"
+#include "settings.h"
 #include "tmr.h"
 
 #define MOT_PAP_MAX_FREQ                  500000
@@ -15,6 +16,8 @@
 
 #define MOT_PAP_POS_THRESHOLD 1
 
+#define MOT_PAP_STALL_MIN_EXPECTED_COUNTS 4 // accumulate pulses until a stall can be told apart from encoder jitter
+
 /**
  * @class 	mot_pap
  * @brief	axis structure.
@@ -58,6 +61,8 @@ class mot_pap {
         counts = reversed_encoder ? -counts : counts;
         encoders->set_counter(name, counts);
         current_counts = counts; // Touch current_counts in just one place
+        backlash_offset = 0;     // Backlash is referred to the next approach direction
+        last_dir = direction::NONE;
     }
 
     void read_pos_from_encoder();
@@ -66,11 +71,14 @@ class mot_pap {
         this->gpios = gpios;
     }
 
-    void set_direction(enum direction direction);
+    void set_direction(enum direction direction, encoders_pico::transaction *t = nullptr);
+
+    void set_direction(encoders_pico::transaction *t = nullptr);
 
-    void set_direction();
+    void set_destination_counts(int target, encoders_pico::transaction *t = nullptr) {
+        requested_counts = target;
+        target += pitch_error(target) + backlash_offset;
 
-    void set_destination_counts(int target) {
         int error = target - current_counts;
         already_there = (std::abs(error) < MOT_PAP_POS_THRESHOLD);
 
@@ -79,7 +87,34 @@ class mot_pap {
             return;
         }
 
-        encoders->set_target(name, reversed_encoder ? -target : target);
+        encoders->set_target(name, reversed_encoder ? -target : target, t);
+    }
+
+    /**
+     * @brief   lead-screw pitch error at this position, linearly interpolated
+     *          between the two surrounding LUT points
+     * @param   counts  : uncompensated position
+     * @returns counts to add to reach the position
+     */
+    int pitch_error(int counts) const {
+        if (compensation.lut_spacing <= 0 || compensation.lut_size < 2) {
+            return 0;
+        }
+
+        int offset = counts - compensation.lut_origin;
+        if (offset <= 0) {
+            return compensation.lut[0];
+        }
+
+        int index = offset / compensation.lut_spacing;
+        if (index >= compensation.lut_size - 1) {
+            return compensation.lut[compensation.lut_size - 1];
+        }
+
+        int fraction = offset - (index * compensation.lut_spacing);
+        int low = compensation.lut[index];
+        int high = compensation.lut[index + 1];
+        return low + static_cast<int>((static_cast<int64_t>(high - low) * fraction) / compensation.lut_spacing);
     }
 
     void step();
@@ -114,6 +149,9 @@ class mot_pap {
     bool reversed_direction = false;
     bool reversed_encoder = false;
     volatile int current_counts = 0;
-    volatile int destination_counts = 0;
+    volatile int destination_counts = 0; // Compensated, as sent to the encoders
+    volatile int requested_counts = 0;   // As requested, before compensation
+    volatile int backlash_offset = 0;
+    axis_compensation compensation = {};
     bool is_dummy;
 };
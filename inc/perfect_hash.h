@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief   FNV-1a, the seed replaces the offset basis to search for a perfect
+ *          hash at compile time
+ */
+constexpr uint32_t fnv1a(const char *str, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    while (*str) {
+        hash ^= static_cast<uint8_t>(*str++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @struct  perfect_hash
+ * @brief   index of a set of names known at compile time, where every name
+ *          gets a slot of its own. A lookup is one hash, the caller confirms
+ *          the name with one string compare.
+ * @note    portable, also built on the host by the lookup benchmark.
+ */
+template <int SLOTS> struct perfect_hash {
+    static_assert((SLOTS & (SLOTS - 1)) == 0, "SLOTS must be a power of two");
+
+    uint32_t seed;       //!< 0 if build() found none
+    int8_t index[SLOTS]; //!< position of the name, -1 if the slot is empty
+
+    /**
+     * @brief   searches the first seed sending every name to its own slot
+     * @param   name     : callable returning the name at a position
+     * @param   count    : names, fewer than SLOTS
+     * @param   max_seed : seeds tried
+     */
+    template <typename Name> static constexpr perfect_hash build(Name name, int count, uint32_t max_seed) {
+        perfect_hash hash = {};
+        for (uint32_t seed = 1; seed < max_seed && hash.seed == 0; seed++) {
+            for (int8_t &index : hash.index) {
+                index = -1;
+            }
+            bool perfect = true;
+            for (int i = 0; i < count && perfect; i++) {
+                int8_t &index = hash.index[fnv1a(name(i), seed) & (SLOTS - 1)];
+                perfect = index < 0;
+                index = static_cast<int8_t>(i);
+            }
+            if (perfect) {
+                hash.seed = seed;
+            }
+        }
+        return hash;
+    }
+
+    /**
+     * @returns position of the only name that may be str, -1 if none
+     */
+    constexpr int find(const char *str) const {
+        return index[fnv1a(str, seed) & (SLOTS - 1)];
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+
+#include "quadrature_encoder_constants.h"
+
+#define PICO_EMULATOR_AXES 4 // X, Y, Z, W
+
+/**
+ * @class   pico_emulator
+ * @brief   emulation of the Raspberry Pi Pico encoders board at the SPI frame
+ *          level, with the quadrature_encoder_constants register map and the
+ *          target reached / limits IRQ line.
+ * @note    portable, it doesn't depend on the LPC or FreeRTOS headers so it
+ *          can be built on the host. The plant model calls move() and
+ *          set_hard_limits(), the firmware side talks to it through frame()
+ *          and watches irq().
+ *
+ *          Frames are recognized by their length:
+ *          - 1 byte: address of the unframed protocol, the next frame carries
+ *            the data to write or clocks out the registers read.
+ *          - 5 * n bytes: batched transaction, address plus 4 data bytes per
+ *            operation, reads answered in place.
+ *          - 1 + 5 * n + 3 bytes: framed transaction, sequence and request
+ *            CRC-8 checked, answered with the echoed sequence and the
+ *            response CRC-8.
+ */
+class pico_emulator {
+  public:
+    void frame(const uint8_t *tx, uint8_t *rx, int len);
+
+    void move(int axis, int32_t counts);
+
+    void set_hard_limits(uint8_t hard);
+
+    /**
+     * @brief   level of the IRQ line, high until the limits are read with
+     *          WRITE_MASK
+     */
+    bool irq() const {
+        return irq_level;
+    }
+
+    int32_t counter(int axis) const {
+        return counters[axis];
+    }
+
+    int32_t target(int axis) const {
+        return targets[axis];
+    }
+
+    int32_t direction(int axis) const {
+        return directions[axis];
+    }
+
+    int32_t servo() const {
+        return pwm_servo;
+    }
+
+    uint32_t frames_count() const {
+        return frames;
+    }
+
+    uint32_t rejected_frames() const {
+        return rejected;
+    }
+
+  private:
+    int32_t read(uint8_t address);
+
+    void write(uint8_t address, int32_t value);
+
+    void op(const uint8_t *tx, uint8_t *rx);
+
+    void update_targets();
+
+    static int axis_of(uint8_t reg, uint8_t base);
+
+    int32_t counters[PICO_EMULATOR_AXES] = {};
+    int32_t targets[PICO_EMULATOR_AXES] = {};
+    int32_t directions[PICO_EMULATOR_AXES] = {};
+    bool targets_armed[PICO_EMULATOR_AXES] = {};
+    int32_t threshold = 1;
+    int32_t pwm_servo = 0;
+    uint8_t hard_limits = 0;
+    uint8_t targets_reached = 0;
+    bool irq_level = false;
+    int pending_address = -1; //!< unframed protocol address waiting for its data frame
+    uint32_t frames = 0;
+    uint32_t rejected = 0;
+};
@@ -22,21 +22,30 @@ constexpr int ENABLED_INPUTS_MASK = 0b0011'1111;
 class rema {
   public:
     static const int BRAKES_RELEASE_DELAY_MS = 200;
+    static const int BRAKES_IDLE_HOLD_MS = 500;
     static const int TOUCH_PROBE_LIFTER_ENERGIZE_DELAY_MS = 400;
     static const int TOUCH_PROBE_LIFTER_DEENERGIZE_DELAY_MS = 1000;
 
     enum class brakes_mode_t { OFF, AUTO, ON };
 
+    enum class brakes_state_t { APPLIED, RELEASING, RELEASED };
+
     static void init_input_outputs();
 
     static void control_enabled_set(bool status);
 
     static bool control_enabled_get();
 
-    static void brakes_release();
+    static void brakes_release(uint32_t request_id = 0);
+
+    static bool brakes_released();
 
     static void brakes_apply();
 
+    static void brakes_apply_after_hold();
+
+    static void brakes_update();
+
     static void touch_probe_extend();
 
     static void touch_probe_retract();
@@ -47,14 +56,29 @@ class rema {
 
     static bool is_watchdog_expired();
 
-    static void hard_limits_reached();
+    static void hard_limits_reached(uint8_t hard);
+
+    /**
+     * @brief   hard limit bits of an axis, left/right for X, up/down for Y and
+     *          in/out for Z
+     */
+    static constexpr uint8_t hard_limits_mask(char axis) {
+        return 0b11 << ((axis - 'X') * 2);
+    }
 
     static bool control_enabled;
     static bool stall_control;
     static bool touch_probe_protection;
     static brakes_mode_t brakes_mode;
+    static volatile brakes_state_t brakes_state;
+    static int brakes_idle_hold_ms;
     static TickType_t lastKeepAliveTicks;
     static TickType_t touch_probe_debounce_time_ms;
     static int touch_probe_retract_angle;
     static int touch_probe_extend_angle;
+
+  private:
+    static volatile uint32_t brakes_deadline_ms;
+    static volatile bool brakes_hold_pending;
+    static volatile uint32_t brakes_request_id; //!< posted to events once the brakes are released
 };
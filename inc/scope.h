@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+
+class bresenham;
+
+#define SCOPE_BUFFER_WORDS 4096 // 16KB, placed in RamLoc40
+#define SCOPE_HEADER_WORDS 2    // timestamp + tag word preceding every sample
+
+/**
+ * @class   scope
+ * @brief   captures controller internals of one axes group into a preallocated
+ *          RAM ring at full supervisor and ISR rate, to be dumped in bulk once
+ *          a trigger fires.
+ * @note    capturing only stores a handful of words, no blocking calls are made
+ *          so the timing of the ISR being measured is not disturbed.
+ */
+class scope {
+  public:
+    enum channel : uint8_t {
+        FREQ = 1 << 0,          //!< current_freq
+        ERROR_TERM = 1 << 1,    //!< bresenham error
+        LEADER_DELTA = 1 << 2,  //!< leader axis delta
+        P_TERM = 1 << 3,        //!< kp proportional term (raw float bits)
+        FIRST_COUNTS = 1 << 4,  //!< first axis current_counts
+        SECOND_COUNTS = 1 << 5, //!< second axis current_counts
+    };
+
+    enum trigger_source : uint8_t {
+        MOVE_START = 1 << 0,
+        STALL = 1 << 1,
+        PROBE = 1 << 2,
+    };
+
+    enum origin : uint8_t { SUPERVISOR, ISR };
+
+    enum class state_t : uint8_t { IDLE, ARMED, TRIGGERED, DONE };
+
+    static void arm();
+
+    static void disarm();
+
+    static void release();
+
+    /**
+     * @brief   records one sample if the scope is recording for these axes
+     * @param   axes    : axes group taking the decision
+     * @param   o       : whether called from the supervisor task or from the ISR
+     */
+    static inline void sample(const bresenham *axes, enum origin o) {
+        if ((state == state_t::ARMED || state == state_t::TRIGGERED) && axes == source) {
+            capture(axes, o);
+        }
+    }
+
+    static void trigger(const bresenham *axes, enum trigger_source src);
+
+    static int words_per_sample();
+
+    static int samples_count();
+
+    static int trigger_index();
+
+    static int region(int part, const uint32_t **start);
+
+    static volatile state_t state;
+    static const bresenham *source;
+    static uint8_t channels;
+    static uint8_t triggers;
+    static int decimation;
+    static int post_trigger;
+    static volatile uint8_t fired_by;
+
+  private:
+    static void capture(const bresenham *axes, enum origin o);
+
+    static void write(const bresenham *axes, enum origin o);
+
+    static uint32_t buffer[SCOPE_BUFFER_WORDS];
+    static volatile int write_index;
+    static volatile bool wrapped;
+    static volatile int remaining;
+    static volatile int trigger_slot;
+    static int stride;
+    static int capacity;
+    static int decimation_counters[2];
+};
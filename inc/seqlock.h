@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#include "board.h"
+
+/**
+ * @class   seqlock
+ * @brief   publishes a value to many readers without making them take a lock.
+ *          Readers retry while the sequence is odd or changed during the copy.
+ * @note    writers must be serialized by the caller.
+ */
+template <typename T> class seqlock {
+  public:
+    /**
+     * @brief   modifies the published value in place
+     * @param   f   : callable receiving a reference to the value
+     */
+    template <typename F> void update(F f) {
+        seq++;
+        __DMB();
+        f(data);
+        __DMB();
+        seq++;
+    }
+
+    void write(const T &value) {
+        update([&value](T &d) { d = value; });
+    }
+
+    T read() const {
+        T copy;
+        uint32_t start;
+        do {
+            while ((start = seq) & 1) {
+            }
+            __DMB();
+            copy = data;
+            __DMB();
+        } while (seq != start);
+        return copy;
+    }
+
+    uint32_t sequence() const {
+        return seq;
+    }
+
+  private:
+    volatile uint32_t seq = 0;
+    T data{};
+};
@@ -11,6 +11,21 @@ struct network_settings {
     uint16_t port;
 };
 
+#define PITCH_LUT_MAX_SIZE 24
+
+/**
+ * @struct  axis_compensation
+ * @brief   backlash and lead-screw pitch error of one axis, in counts.
+ *          All zeros (erased EEPROM) means no compensation.
+ */
+struct axis_compensation {
+    int32_t backlash;                 //!< counts to take up on direction reversal
+    int32_t lut_origin;               //!< position of the first pitch error point
+    int32_t lut_spacing;              //!< distance between pitch error points, 0 disables the LUT
+    int32_t lut_size;                 //!< number of valid points in lut
+    int16_t lut[PITCH_LUT_MAX_SIZE];  //!< pitch error at every point
+};
+
 class settings {
   public:
     static network_settings network;
@@ -27,6 +42,10 @@ class settings {
     static void save();
 
     static void read();
+
+    static void save_compensation(char axis, axis_compensation &compensation);
+
+    static void read_compensation(char axis, axis_compensation &compensation);
 };
 
 inline network_settings settings::network;
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "tcp_server.h"
+
+/**
+ * @class   socket_writer
+ * @brief   ArduinoJson writer sending the serialized document in chunks of the
+ *          supplied buffer, usually TCP_MSS bytes, so answers of any size go
+ *          out without a contiguous buffer holding all of them.
+ * @note    after a failed send every write() returns 0, which makes
+ *          ArduinoJson give up serializing. Call flush() at the end to send
+ *          the last chunk.
+ */
+class socket_writer {
+  public:
+    socket_writer(int sock, uint8_t *buffer, size_t size) : sock(sock), buffer(buffer), size(size) {
+    }
+
+    size_t write(uint8_t c) {
+        if (len == size && !flush()) {
+            return 0;
+        }
+        buffer[len++] = c;
+        return 1;
+    }
+
+    size_t write(const uint8_t *s, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            if (len == size && !flush()) {
+                return done;
+            }
+            size_t chunk = (n - done < size - len) ? n - done : size - len;
+            memcpy(&buffer[len], &s[done], chunk);
+            len += chunk;
+            done += chunk;
+        }
+        return done;
+    }
+
+    /**
+     * @brief   sends what is waiting in the buffer
+     * @returns false if the connection failed, now or before
+     */
+    bool flush() {
+        if (!failed && len > 0) {
+            failed = !tcp_server::send_all(sock, buffer, static_cast<int>(len));
+            sent += len;
+        }
+        len = 0;
+        return !failed;
+    }
+
+    size_t sent_bytes() const {
+        return sent;
+    }
+
+  private:
+    int sock;
+    uint8_t *buffer;
+    size_t size;
+    size_t len = 0;
+    size_t sent = 0;
+    bool failed = false;
+};
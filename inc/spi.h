@@ -6,6 +6,7 @@
 
 #include "FreeRTOS.h"
 #include "semphr.h"
+#include "task.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,16 +15,27 @@ extern "C" {
 #define LPC_SSP       LPC_SSP1
 #define SSP_DATA_BITS (SSP_BITS_8)
 
-inline SemaphoreHandle_t encoders_mutex;
+#define SSP_DEFAULT_BITRATE    (5000 * 1000)
+#define SSP_DEFAULT_GUARD_US   2 // Si RPI PICO está haciendo printf para debug poner 500
+
+#define SSP_DMA_TX_CHANNEL     1 // Channel 0 is used by the debug UART
+#define SSP_DMA_RX_CHANNEL     2
+#define SSP_DMA_MAX_LENGTH     64
+#define SSP_DMA_TIMEOUT_MS     10
+
+inline SemaphoreHandle_t spi_dma_done_semaphore; // Binary semaphore, task notification bits are used by the supervisors
+inline void (*spi_dma_done_hook)(BaseType_t *xHigherPriorityTaskWoken) = nullptr; // Chains asynchronous transfers
+inline uint32_t spi_bitrate = SSP_DEFAULT_BITRATE;
+inline int spi_guard_us = SSP_DEFAULT_GUARD_US; // CS setup and hold times for the PICO
+inline uint8_t spi_dma_dummy_tx[SSP_DMA_MAX_LENGTH];
+inline uint8_t spi_dma_dummy_rx[SSP_DMA_MAX_LENGTH];
 
 /**
  * \brief 	initializes SSP bus to transfer SPI frames as a MASTER.
  * @returns	noting
- * @note 	sets SPI bitrate to 1Mhz SEE IF WE CAN IMPROVE THAT.
+ * @note 	starts at SSP_DEFAULT_BITRATE, encoders_pico calibrates it at boot.
  */
 static inline void spi_init(void) {
-    encoders_mutex = xSemaphoreCreateMutex();
-
     Board_SSP_Init(LPC_SSP);
     Chip_SSP_Init(LPC_SSP);
 
@@ -33,17 +45,116 @@ static inline void spi_init(void) {
     ssp_format.clockMode = SSP_CLOCK_MODE3;
     Chip_SSP_SetFormat(LPC_SSP, ssp_format.bits, ssp_format.frameFormat, ssp_format.clockMode);
 
-    Chip_SSP_SetBitRate(LPC_SSP, 5000 * 1000);
+    Chip_SSP_SetBitRate(LPC_SSP, spi_bitrate);
     Chip_SSP_Enable(LPC_SSP);
     Chip_SSP_SetMaster(LPC_SSP, 1);
+
+    // GPDMA clock and DMA_IRQn are already set up by debugInit()
+    spi_dma_done_semaphore = xSemaphoreCreateBinary();
+    Chip_SSP_DMA_Enable(LPC_SSP);
+}
+
+static inline void spi_set_bitrate(uint32_t bitrate) {
+    spi_bitrate = bitrate;
+    Chip_SSP_SetBitRate(LPC_SSP, bitrate);
+}
+
+static inline void spi_guard_delay(void) {
+    if (spi_guard_us > 0) {
+        udelay(spi_guard_us);
+    }
 }
 
 static inline void spi_de_init(void) {
-    vSemaphoreDelete(encoders_mutex);
+    vSemaphoreDelete(spi_dma_done_semaphore);
 
+    Chip_SSP_DMA_Disable(LPC_SSP);
     Chip_SSP_DeInit(LPC_SSP);
 }
 
+/**
+ * \brief 	handles the SSP DMA channels interrupts.
+ * @param 	xHigherPriorityTaskWoken	: set if the waiting task was woken
+ * @returns	nothing
+ * @note 	to be called from DMA_IRQHandler. Completions go to spi_dma_done_hook
+ * if one is installed.
+ */
+static inline void spi_dma_isr(BaseType_t *xHigherPriorityTaskWoken) {
+    if (Chip_GPDMA_IntGetStatus(LPC_GPDMA, GPDMA_STAT_INTTC, SSP_DMA_TX_CHANNEL)) {
+        Chip_GPDMA_ClearIntPending(LPC_GPDMA, GPDMA_STATCLR_INTTC, SSP_DMA_TX_CHANNEL);
+    }
+
+    // Reception always ends last, the whole frame has been clocked by then
+    if (Chip_GPDMA_IntGetStatus(LPC_GPDMA, GPDMA_STAT_INTTC, SSP_DMA_RX_CHANNEL)) {
+        Chip_GPDMA_ClearIntPending(LPC_GPDMA, GPDMA_STATCLR_INTTC, SSP_DMA_RX_CHANNEL);
+        if (spi_dma_done_hook) {
+            spi_dma_done_hook(xHigherPriorityTaskWoken);
+        } else {
+            xSemaphoreGiveFromISR(spi_dma_done_semaphore, xHigherPriorityTaskWoken);
+        }
+    }
+}
+
+/**
+ * \brief 	starts a GPDMA transfer and returns right away
+ * @param 	tx	: bytes to send, dummy bytes if nullptr
+ * @param 	rx	: received bytes, discarded if nullptr
+ * @param 	len	: bytes count, up to SSP_DMA_MAX_LENGTH
+ * @returns	nothing
+ */
+static inline void spi_dma_start(const uint8_t *tx, uint8_t *rx, uint32_t len) {
+    tx = tx ? tx : spi_dma_dummy_tx;
+    rx = rx ? rx : spi_dma_dummy_rx;
+
+    Chip_GPDMA_Transfer(LPC_GPDMA,
+                        SSP_DMA_RX_CHANNEL,
+                        GPDMA_CONN_SSP1_Rx,
+                        (uint32_t)rx,
+                        GPDMA_TRANSFERTYPE_P2M_CONTROLLER_DMA,
+                        len);
+    Chip_GPDMA_Transfer(LPC_GPDMA,
+                        SSP_DMA_TX_CHANNEL,
+                        (uint32_t)tx,
+                        GPDMA_CONN_SSP1_Tx,
+                        GPDMA_TRANSFERTYPE_M2P_CONTROLLER_DMA,
+                        len);
+}
+
+/**
+ * \brief 	starts one CS frame through GPDMA, completion is reported to
+ * spi_dma_done_hook
+ */
+static inline void spi_frame_start(const uint8_t *tx, uint8_t *rx, uint16_t len) {
+    Chip_SSP_Int_FlushData(LPC_SSP);
+    spi_dma_start(tx, rx, len);
+}
+
+static inline void spi_dma_stop(void) {
+    Chip_GPDMA_Stop(LPC_GPDMA, SSP_DMA_TX_CHANNEL);
+    Chip_GPDMA_Stop(LPC_GPDMA, SSP_DMA_RX_CHANNEL);
+}
+
+/**
+ * \brief 	transfers the frames through GPDMA, the calling task blocks until
+ * the reception channel completes.
+ * @param 	xfer_setup	: transfer, missing tx_data sends dummy bytes and
+ * missing rx_data discards the received ones
+ * @returns	0 on success, -1 on timeout
+ */
+static inline int32_t spi_dma_transfer(Chip_SSP_DATA_SETUP_T *xfer_setup) {
+    uint32_t len = xfer_setup->length;
+
+    xSemaphoreTake(spi_dma_done_semaphore, 0); // Drop a completion left by a timed out transfer
+    spi_dma_start(static_cast<const uint8_t *>(xfer_setup->tx_data), static_cast<uint8_t *>(xfer_setup->rx_data), len);
+
+    if (xSemaphoreTake(spi_dma_done_semaphore, pdMS_TO_TICKS(SSP_DMA_TIMEOUT_MS)) != pdPASS) {
+        spi_dma_stop();
+        return -1;
+    }
+    xfer_setup->rx_cnt = xfer_setup->tx_cnt = len;
+    return 0;
+}
+
 /**
  * \brief 	executes SPI transfers synchronized by CS.
  * @param 	xfers			: pointer to array of transfers
@@ -54,21 +165,28 @@ static inline void spi_de_init(void) {
  * @note 	this function takes a mutex to avoid interleaving transfers to
  * both RDCs. could work without mutex but debugging with a logic analyzer would
  * be more confusing.
+ * @note 	once the scheduler runs frames go through GPDMA and the calling task
+ * sleeps during the transfer.
  */
 static inline int32_t spi_sync_transfer(Chip_SSP_DATA_SETUP_T *xfer_setup, void (*cs)(bool) = nullptr) {
+    int32_t ret = 0;
     if (cs != NULL) {
         cs(0);
     }
-    udelay(2); // Si RPI PICO está haciendo printf para debug poner udelay(500)
+    spi_guard_delay();
     Chip_SSP_Int_FlushData(LPC_SSP);
-    Chip_SSP_RWFrames_Blocking(LPC_SSP, xfer_setup);
+    if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING && xfer_setup->length <= SSP_DMA_MAX_LENGTH) {
+        ret = spi_dma_transfer(xfer_setup);
+    } else {
+        Chip_SSP_RWFrames_Blocking(LPC_SSP, xfer_setup);
+    }
     Chip_SSP_Int_FlushData(LPC_SSP);
-    udelay(2); // Si RPI PICO está haciendo printf para debug poner udelay(500)
+    spi_guard_delay();
     if (cs != NULL) {
         cs(1);
     }
-    udelay(2); // Si RPI PICO está haciendo printf para debug poner udelay(500)
-    return 0;
+    spi_guard_delay();
+    return ret;
 }
 
 /**
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+
+#include "board.h"
+
+#define SPI_STATS_BUCKETS 12 // log2 microseconds buckets, the last one collects everything above
+
+/**
+ * @struct  latency_histogram
+ * @brief   durations measured with DWT->CYCCNT, bucketed by powers of two
+ *          microseconds: <1, <2, <4 ... <1024, >=1024.
+ */
+struct latency_histogram {
+    uint32_t buckets[SPI_STATS_BUCKETS];
+    uint32_t count;
+    uint32_t max_cycles;
+
+    void record(uint32_t cycles) {
+        uint32_t us = cycles / (SystemCoreClock / 1000000);
+        int bucket = 0;
+        while (us && bucket < SPI_STATS_BUCKETS - 1) {
+            us >>= 1;
+            bucket++;
+        }
+        buckets[bucket]++;
+        count++;
+        if (cycles > max_cycles) {
+            max_cycles = cycles;
+        }
+    }
+};
+
+/**
+ * @class   spi_stats
+ * @brief   bus wait and transfer duration per encoders_pico call site. The
+ *          wait goes from the call to the first frame of the request, lane
+ *          and queue, the transfer from there until its last frame completed.
+ * @note    records are made while holding the lane of the caller. Call sites
+ *          used from several priority classes may rarely lose a count.
+ */
+class spi_stats {
+  public:
+    enum call_site {
+        WRITE_REGISTER,
+        READ_REGISTER,
+        READ_4_REGISTERS,
+        READ_LIMITS,
+        READ_LIMITS_AND_ACK,
+        TRANSACTION,
+        CALL_SITES_COUNT
+    };
+
+    static constexpr const char *names[CALL_SITES_COUNT] = {
+        "write_register", "read_register", "read_4_registers", "read_limits", "read_limits_and_ack", "transaction"
+    };
+
+    static void reset() {
+        for (int i = 0; i < CALL_SITES_COUNT; i++) {
+            wait[i] = {};
+            transfer[i] = {};
+        }
+    }
+
+    static inline latency_histogram wait[CALL_SITES_COUNT];
+    static inline latency_histogram transfer[CALL_SITES_COUNT];
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "tmr.h"
+
+#define SUPERVISOR_TIMEBASE_HZ 1000
+#define SUPERVISOR_MAX_AXES    2
+
+class bresenham;
+
+/**
+ * @class   supervisor_timebase
+ * @brief   hardware timer that tells every moving axes group which of its
+ *          supervisor checks are due, each one at its own rate.
+ */
+class supervisor_timebase {
+  public:
+    static void init();
+
+    static void add(bresenham *axes);
+
+    static void isr();
+
+    static uint32_t millis() {
+        return ms;
+    }
+
+    static class tmr *tmr;
+
+  private:
+    static bresenham *axes[SUPERVISOR_MAX_AXES];
+    static int axes_count;
+    static volatile uint32_t ms;
+};
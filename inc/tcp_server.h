@@ -14,8 +14,19 @@ class tcp_server {
 
     virtual void reply_fn(int sock) = 0;
 
-    void task();
+    virtual void task();
+
+    void start();
+
+    static bool send_all(int sock, const void *buf, int len);
 
     const char *name;
     int port;
+
+  protected:
+    int listen_socket(int backlog);
+
+    static void set_keepalive(int sock);
+
+    static void stop_all();
 };
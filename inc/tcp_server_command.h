@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #include "FreeRTOS.h"
@@ -13,100 +14,160 @@
 #include "arduinojson_cust_alloc.h"
 #include "debug.h"
 #include "rema.h"
+#include "socket_writer.h"
 #include "tcp_server.h"
 #include "xy_axes.h"
 #include "z_axis.h"
 
+#define TCP_SERVER_COMMAND_MAX_CLIENTS 3
+#define TCP_SERVER_COMMAND_FRAME_HEADER 2    // big endian payload length
+#define TCP_SERVER_COMMAND_MAX_FRAME    1024 // payload, must stay below '[' << 8 to tell legacy clients apart
+#define TCP_SERVER_COMMAND_ARENA_SIZE   (8 * 1024) // every document of one request
+#define TCP_SERVER_COMMAND_EVENTS_POLL_MS 2 // longest an event waits in the queue while the clients are idle
+#define CMD_HASH_SLOTS                  128  // power of two, perfect hash of the command names
+#define CMD_HASH_MAX_SEED               20000
+
 namespace json = ArduinoJson;
 
+/**
+ * @class   tcp_server_command
+ * @brief   serves up to TCP_SERVER_COMMAND_MAX_CLIENTS clients from a single
+ *          task. Commands flagged requires_control can only be run by the
+ *          client holding motion control, which takes it with its first such
+ *          command (or CONTROL) while nobody holds it. The axes are only
+ *          stopped when that client leaves, monitoring clients come and go
+ *          freely.
+ * @note    every request and answer is a frame: TCP_SERVER_COMMAND_FRAME_HEADER
+ *          bytes with the big endian payload length followed by the payload.
+ *          Frames are reassembled across recv() calls, all the complete ones
+ *          are run in order and oversize ones are answered with an error and
+ *          skipped. Clients starting with '[' are served unframed as before.
+ *
+ *          Commands may carry a request id, echoed in their answer. Moves,
+ *          brake changes and touch probe actions with one push an EVENT with
+ *          that id and the time they completed or failed to the client
+ *          holding motion control.
+ */
 class tcp_server_command : public tcp_server {
   public:
     tcp_server_command(int port) : tcp_server("command", port) {
     }
 
-    static bresenham *get_axes(const char *axis);
+    enum protocol {
+        JSON,    //!< text, {"cmd": name, "pars": {...}} objects
+        MSGPACK, //!< binary, [command id, [parameter key id, value, ...]] arrays
+    };
 
-    void reply_fn(int sock) override {
-        int len;
-        char rx_buffer[1024];
-
-        do {
-            len = lwip_recv(sock, rx_buffer, sizeof(rx_buffer) - 1, 0);
-            if (len < 0) {
-                lDebug(Error, "Error occurred during receiving command: errno %d", errno);
-                return;
-            } else if (len == 0) {
-                lDebug(Warn, "Command connection closed");
-                return;
-            } else {
-                // rema::update_watchdog_timer();
-                rx_buffer[len] = 0; // Null-terminate whatever is received and treat it like a string
-                lDebug_uart_semihost(Info, "Command received %s", rx_buffer);
-
-                char *tx_buffer;
-
-                int ack_len = json_wp(rx_buffer, &tx_buffer);
-
-                // lDebug_uart_semihost(Info, "To send %d bytes: %s", ack_len, tx_buffer);
-
-                if (ack_len > 0) {
-                    // send() can return less bytes than supplied length.
-                    // Walk-around for robust implementation.
-                    int to_write = ack_len;
-
-                    while (to_write > 0) {
-                        int written = lwip_send(sock, tx_buffer + (ack_len - to_write), to_write, 0);
-                        if (written < 0) {
-                            lDebug(Error, "Error occurred during sending command: errno %d", errno);
-                            if (tx_buffer) {
-                                delete[] tx_buffer;
-                                tx_buffer = NULL;
-                            }
-                            return;         // Returning here will recreate the socket
-                        }
-                        to_write -= written;
-                    }
-
-                    if (tx_buffer) {
-                        delete[] tx_buffer;
-                        tx_buffer = NULL;
-                    }
-                }
-            }
-        } while (len > 0);
-    }
+    static bresenham *get_axes(const char *axis);
 
-    json::MyJsonDocument logs_cmd(json::JsonObject const pars);
-    json::MyJsonDocument log_level_cmd(json::JsonObject const pars);
-    json::MyJsonDocument protocol_version_cmd(json::JsonObject const pars);
-    json::MyJsonDocument control_enable_cmd(json::JsonObject const pars);
-    json::MyJsonDocument stall_control_settings_cmd(json::JsonObject const pars);
-    json::MyJsonDocument touch_probe_settings_cmd(json::JsonObject const pars);
-    json::MyJsonDocument set_coords_cmd(json::JsonObject const pars);
-    json::MyJsonDocument axes_settings_cmd(json::JsonObject const pars);
-    json::MyJsonDocument axes_hard_stop_all_cmd(json::JsonObject const pars);
-    json::MyJsonDocument axes_soft_stop_all_cmd(json::JsonObject const pars);
-    json::MyJsonDocument network_settings_cmd(json::JsonObject const pars);
-    json::MyJsonDocument mem_info_cmd(json::JsonObject const pars);
-    json::MyJsonDocument temperature_info_cmd(json::JsonObject const pars);
-    json::MyJsonDocument move_closed_loop_cmd(json::JsonObject const pars);
-    json::MyJsonDocument move_joystick_cmd(json::JsonObject const pars);
-    json::MyJsonDocument move_incremental_cmd(json::JsonObject const pars);
-    json::MyJsonDocument brakes_mode_cmd(json::JsonObject const pars);
-    json::MyJsonDocument touch_probe_cmd(json::JsonObject const pars);
-    json::MyJsonDocument read_encoders_cmd(json::JsonObject const pars);
-    json::MyJsonDocument read_limits_cmd(json::JsonObject const pars);
-    json::MyJsonDocument cmd_execute(char const *cmd, json::JsonObject const pars);
-
-    int json_wp(char *rx_buff, char **tx_buff);
+    static mot_pap *get_axis(const char *axis);
+
+    void task() override;
+
+    void reply_fn([[maybe_unused]] int sock) override {
+    } // Unused, task() serves the clients through serve()
+
+    void logs_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void log_level_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void protocol_version_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void control_enable_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void stall_control_settings_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void touch_probe_settings_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void set_coords_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void axes_settings_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void axes_hard_stop_all_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void axes_soft_stop_all_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void network_settings_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void mem_info_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void temperature_info_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void move_closed_loop_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void move_joystick_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void move_incremental_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void brakes_mode_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void touch_probe_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void read_encoders_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void read_limits_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void scope_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void autotune_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void compensation_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void encoders_settings_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void spi_stats_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void control_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void cmd_stats_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void udp_telemetry_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void telemetry_config_cmd(json::JsonObject const pars, json::JsonVariant res);
+    void cmd_execute(char const *cmd, json::JsonObject const pars, json::JsonVariant res);
+    void cmd_run(int index, json::JsonObject const pars, json::JsonVariant res);
+
+    static int cmd_lookup(char const *cmd);
 
     // FredMemFn points to a member of Fred that takes (char,float)
-    typedef json::MyJsonDocument (tcp_server_command::*cmd_function_ptr)(json::JsonObject pars);
+    typedef void (tcp_server_command::*cmd_function_ptr)(json::JsonObject pars, json::JsonVariant res);
 
     typedef struct {
         const char *cmd_name;
         cmd_function_ptr cmd_function;
+        bool requires_control; //!< only the client holding motion control can run it
     } cmd_entry;
 
     static const cmd_entry cmds_table[];
+
+    static const char *const param_keys[]; //!< MSGPACK parameter key ids, append only. Interned, they are
+                                           //!< linked into the pars objects instead of copied
+
+  private:
+    /**
+     * @struct  client
+     * @brief   connection state of one command client.
+     */
+    struct client {
+        int sock = -1; //!< -1 if the slot is free
+        enum protocol protocol = JSON;
+        bool detected = false; //!< framing told apart from the first byte received
+        bool legacy = false;   //!< unframed JSON, every recv is taken as a whole document
+        int rx_len = 0;        //!< bytes waiting in the reassembly buffer
+        int discard = 0;       //!< bytes left of a rejected oversize frame
+    };
+
+    void accept_client(int listen_sock);
+
+    void drop_client(int index);
+
+    bool serve(int index);
+
+    bool run_frame(client &c, const char *payload, int len);
+
+    bool json_wp(const char *rx_buff, int rx_len, client &c);
+
+    bool msgpack_wp(const char *rx_buff, int rx_len, client &c);
+
+    bool send_answer(client &c, json::JsonDocument &doc);
+
+    bool send_parse_error(client &c, json::JsonDocument &doc);
+
+    void echo_request_id(json::JsonVariant answer);
+
+    void push_events();
+
+    bool take_control();
+
+    static void list_ids(json::JsonArray commands, json::JsonArray keys);
+
+    client clients[TCP_SERVER_COMMAND_MAX_CLIENTS];
+    int current = -1;                        //!< client whose commands are being run
+    int owner = -1;                          //!< client holding motion control, -1 if nobody
+    enum protocol requested_protocol = JSON; //!< protocol of the current client after this batch
+    uint32_t request_id = 0;                 //!< of the command being run, 0 if it has none
+
+    // Backs the documents of the request being run. The event
+    // loop runs one request at a time, so all the clients share it
+    alignas(std::max_align_t) static inline uint8_t arena_buffer[TCP_SERVER_COMMAND_ARENA_SIZE];
+    ArenaAllocator arena{ arena_buffer, sizeof(arena_buffer) };
+
+    // Answers are serialized into it and sent one segment at a time
+    static inline uint8_t tx_chunk[TCP_MSS];
+
+    // Reassembly buffers, too big for the stack of the task constructing the server
+    static inline char rx_buffers[TCP_SERVER_COMMAND_MAX_CLIENTS]
+                                 [TCP_SERVER_COMMAND_FRAME_HEADER + TCP_SERVER_COMMAND_MAX_FRAME + 1];
 };
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+#include <lwip/netdb.h>
+
+#include "debug.h"
+
+#include "scope.h"
+#include "tcp_server.h"
+
+#define SCOPE_DUMP_VERSION 1
+#define SCOPE_POLL_MS      10
+
+/**
+ * @struct  scope_dump_header
+ * @brief   precedes every binary scope dump. Samples follow in chronological
+ *          order, words_per_sample little endian 32 bits words each.
+ */
+struct scope_dump_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t words_per_sample;
+    uint8_t channels;
+    uint8_t fired_by;
+    uint32_t samples;
+    uint32_t trigger_index;
+    uint32_t cpu_clock_hz;
+};
+
+class tcp_server_scope : public tcp_server {
+  public:
+    tcp_server_scope(int port) : tcp_server("scope", port) {
+    }
+
+    void reply_fn(int sock) override {
+        while (true) {
+            if (scope::state != scope::state_t::DONE) {
+                if (!client_connected(sock)) {
+                    return;
+                }
+                continue;
+            }
+
+            scope_dump_header header = { { 'S', 'C', 'O', 'P' },
+                                         SCOPE_DUMP_VERSION,
+                                         static_cast<uint8_t>(scope::words_per_sample()),
+                                         scope::channels,
+                                         scope::fired_by,
+                                         static_cast<uint32_t>(scope::samples_count()),
+                                         static_cast<uint32_t>(scope::trigger_index()),
+                                         SystemCoreClock };
+
+            if (!send_all(sock, &header, sizeof(header))) {
+                return;
+            }
+
+            for (int part = 0; part < 2; part++) {
+                const uint32_t *start;
+                int words = scope::region(part, &start);
+                if (words > 0 && !send_all(sock, start, words * sizeof(uint32_t))) {
+                    return;
+                }
+            }
+
+            lDebug(Info, "Scope dump sent, %i samples", scope::samples_count());
+            scope::release();
+        }
+    }
+
+  private:
+    /**
+     * @brief   waits up to SCOPE_POLL_MS for the client to close the socket,
+     *          anything it sends is discarded
+     * @returns false if the client left or the socket failed
+     */
+    static bool client_connected(int sock) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(sock, &read_set);
+        struct timeval timeout = { 0, SCOPE_POLL_MS * 1000 };
+        int ready = lwip_select(sock + 1, &read_set, NULL, NULL, &timeout);
+        if (ready < 0) {
+            return false;
+        }
+        if (ready == 0) {
+            return true;
+        }
+
+        uint8_t discard[32];
+        int len = lwip_recv(sock, discard, sizeof(discard), MSG_DONTWAIT);
+        if (len == 0 || (len < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+            lDebug(Info, "Scope client left before the capture");
+            return false;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+
+#include "arduinojson_cust_alloc.h"
+
+#define TELEMETRY_DEFAULT_PERIOD_MS 100
+#define TELEMETRY_MIN_PERIOD_MS     5
+#define TELEMETRY_MAX_PERIOD_MS     10000
+#define TELEMETRY_TCP_MAX_PERIOD_MS 500 // Each TCP frame sent feeds the watchdog, below WATCHDOG_TIME_MS
+#define TELEMETRY_AXES              3  // x, y, z
+#define TELEMETRY_FIELDS            31 // entries of telemetry::fields[], at most 64
+
+namespace json = ArduinoJson;
+
+struct encoders_snapshot;
+
+/**
+ * @struct  telemetry_config
+ * @brief   what one telemetry stream sends and how often.
+ */
+struct telemetry_config {
+    volatile uint32_t groups;       //!< telemetry::group bits
+    volatile uint8_t axes;          //!< bit 0 for x, 1 for y and 2 for z, for the per axis groups
+    volatile int period_ms;
+    volatile int keyframe_every;    //!< delta frames with a keyframe every N frames, 0 for nested documents
+};
+
+/**
+ * @class   telemetry
+ * @brief   builds the telemetry document shared by the TCP server and the UDP
+ *          publisher, with only the field groups and axes subscribed in the
+ *          stream configuration.
+ * @note    every consumer keeps its own instance, so each one gets the
+ *          temperatures once per new reading and its own delta state.
+ *
+ *          Nested documents are {"telemetry": {"coords": {"x": ...}, ...}}.
+ *          Delta frames are {"key": bool, "d": [field id, value, ...]}, field
+ *          ids being positions in fields[]. Keyframes carry every subscribed
+ *          field, the frames in between only the ones that changed.
+ */
+class telemetry {
+  public:
+    enum group : uint32_t {
+        COORDS = 1 << 0,      //!< positions, the encoders are only read for them
+        TARGETS = 1 << 1,     //!< destinations and on_condition
+        LIMITS = 1 << 2,      //!< hard limits and probe input
+        STALLED = 1 << 3,
+        PROBE = 1 << 4,       //!< stopped by the probe or its protection
+        TEMPS = 1 << 5,       //!< only when there are new readings
+        DIAGNOSTICS = 1 << 6, //!< control, stall control, brakes mode and SPI link counters
+        GROUPS_COUNT = 7,
+        ALL = (1 << GROUPS_COUNT) - 1,
+    };
+
+    enum stream { TCP, UDP, STREAMS_COUNT };
+
+    /**
+     * @struct  value
+     * @brief   sample of one field, compared against the last one sent.
+     */
+    struct value {
+        enum kind : uint8_t { REAL, INTEGER, BOOLEAN } kind;
+        union {
+            double real;
+            int32_t integer;
+            bool boolean;
+        };
+
+        bool operator==(const value &other) const;
+
+        template <typename T> void store(T target) const {
+            switch (kind) {
+            case REAL: target.set(real); break;
+            case INTEGER: target.set(integer); break;
+            case BOOLEAN: target.set(boolean); break;
+            }
+        }
+    };
+
+    /**
+     * @struct  field
+     * @brief   one telemetry field, its id is the position in fields[].
+     */
+    struct field {
+        uint32_t group;
+        int axis;           //!< filtered by the subscribed axes, -1 if it isn't per axis
+        const char *parent; //!< object holding it in nested documents, nullptr if right in "telemetry"
+        const char *key;
+        value (*read)(const encoders_snapshot &snapshot, int axis); //!< snapshot is read once per build()
+    };
+
+    static constexpr const char *group_names[GROUPS_COUNT] = {
+        "coords", "targets", "limits", "stalled", "probe", "temps", "diagnostics",
+    };
+
+    static constexpr const char *stream_names[STREAMS_COUNT] = { "TCP", "UDP" };
+
+    static inline telemetry_config configs[STREAMS_COUNT] = {
+        { ALL, 0b111, TELEMETRY_DEFAULT_PERIOD_MS, 0 },
+        { ALL, 0b111, TELEMETRY_DEFAULT_PERIOD_MS, 0 },
+    };
+
+    static const field fields[TELEMETRY_FIELDS]; //!< append only, the ids are part of the protocol
+
+    explicit telemetry(const telemetry_config &config) : config(config) {
+    }
+
+    void build(json::JsonDocument &ans);
+
+    static void list_fields(json::JsonArray names);
+
+  private:
+    void build_nested(json::JsonDocument &ans, const encoders_snapshot &snapshot, uint32_t groups, uint8_t axes);
+
+    void build_delta(json::JsonDocument &ans, const encoders_snapshot &snapshot, uint32_t groups, uint8_t axes,
+                     int keyframe_every);
+
+    static bool subscribed(const field &f, uint32_t groups, uint8_t axes);
+
+    const telemetry_config &config;
+    uint32_t built_groups = 0; //!< subscription the document was built for, cleared when it changes
+    uint8_t built_axes = 0;
+    bool built_delta = false;
+    uint32_t temps_seen = 0;   //!< temps_readings when the temperatures were last added
+    value last[TELEMETRY_FIELDS] = {};
+    uint64_t sent = 0;         //!< fields whose last value is in last[]
+    int frames_since_key = 0;
+};
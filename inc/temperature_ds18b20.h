@@ -4,7 +4,7 @@
 #include "gpio_templ.h"
 #include "one-wire_bitbang_master.hpp"
 
-inline volatile bool new_temps_available = false;
+inline volatile uint32_t temps_readings = 0; // incremented on every new set of readings
 
 void temperature_ds18b20_init();
 
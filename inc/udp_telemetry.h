@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "lwip/ip_addr.h"
+
+#define UDP_TELEMETRY_MAX_DESTINATIONS  4
+#define UDP_TELEMETRY_MAX_FRAME         1472 // Ethernet MTU minus the IP and UDP headers, never fragmented
+#define UDP_TELEMETRY_TASK_PRIORITY     (tskIDLE_PRIORITY + 2)
+
+/**
+ * @struct  udp_telemetry_destination
+ * @brief   unicast or multicast address and port the frames are sent to.
+ */
+struct udp_telemetry_destination {
+    ip_addr_t addr;
+    uint16_t port;
+};
+
+/**
+ * @class   udp_telemetry
+ * @brief   publishes the telemetry document as a MsgPack datagram every
+ *          period of the UDP telemetry stream, serialized once and sent to
+ *          every destination.
+ * @note    a slow or missing consumer can't stall it, datagrams are just
+ *          lost. Frames carry a sequence number so the consumers count them.
+ *          Unlike the TCP telemetry it doesn't feed the watchdog, nothing
+ *          tells that anybody is listening.
+ */
+class udp_telemetry {
+  public:
+    static void start();
+
+    static bool add_destination(ip_addr_t addr, uint16_t port);
+
+    static void clear_destinations();
+
+    static int get_destinations(udp_telemetry_destination *out);
+
+    static volatile bool enabled;
+    static volatile uint32_t seq;       //!< of the last frame built
+    static volatile uint32_t errors;    //!< sendto() failures
+    static volatile uint32_t oversize;  //!< frames not sent, bigger than UDP_TELEMETRY_MAX_FRAME
+
+  private:
+    static void task(void *pars);
+
+    static udp_telemetry_destination destinations[UDP_TELEMETRY_MAX_DESTINATIONS];
+    static int destinations_count;
+    static uint8_t frame[UDP_TELEMETRY_MAX_FRAME];
+};
@@ -0,0 +1,231 @@
+#include "autotune.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "bresenham.h"
+#include "debug.h"
+#include "mot_pap.h"
+#include "rema.h"
+
+volatile bool autotune::running = false;
+bresenham *autotune::axes = nullptr;
+autotune_trial autotune::trials[autotune::MAX_TRIALS];
+int autotune::trials_count = 0;
+int autotune::best = -1;
+bool autotune::applied = false;
+int autotune::proposed_normal_min = 0;
+int autotune::proposed_normal_max = 0;
+int autotune::proposed_slow_min = 0;
+int autotune::proposed_slow_max = 0;
+int autotune::distance_counts = 0;
+int autotune::max_overshoot = 0;
+bool autotune::apply = false;
+
+/**
+ * @brief   starts the step response experiment in its own task
+ * @param   axes            : axes group to tune
+ * @param   distance_counts : step size for the first axis
+ * @param   gains           : kp_ values to try
+ * @param   max_freqs       : normal max outputs to try, current one if none
+ * @param   max_overshoot   : trials overshooting more counts are discarded
+ * @param   apply           : apply the best trial or just propose it
+ * @returns false if an experiment is already running
+ */
+bool autotune::start(
+    bresenham *axes,
+    int distance_counts,
+    const float *gains,
+    int gains_count,
+    const int *max_freqs,
+    int max_freqs_count,
+    int max_overshoot,
+    bool apply) {
+    // The slow limits are scaled by normal_out_max, an unconfigured axes group can't be tuned
+    if (running || distance_counts == 0 || gains_count == 0 || axes->kp.normal_out_max <= 0) {
+        return false;
+    }
+
+    autotune::axes = axes;
+    autotune::distance_counts = distance_counts;
+    autotune::max_overshoot = max_overshoot;
+    autotune::apply = apply;
+
+    trials_count = 0;
+    for (int g = 0; g < gains_count; g++) {
+        for (int f = 0; f < std::max(max_freqs_count, 1); f++) {
+            if (trials_count >= MAX_TRIALS) {
+                break;
+            }
+            autotune_trial &trial = trials[trials_count++];
+            trial = {};
+            trial.gain = gains[g];
+            trial.max_freq = max_freqs_count ? max_freqs[f] : axes->kp.normal_out_max;
+        }
+    }
+    best = -1;
+    applied = false;
+
+    running = true;
+    if (xTaskCreate(autotune::task, "autotune", 256, NULL, AUTOTUNE_TASK_PRIORITY, NULL) != pdPASS) {
+        running = false;
+        return false;
+    }
+    lDebug(Info, "%s: autotune started, %i trials", axes->name, trials_count);
+    return true;
+}
+
+bool autotune::wait_until_stopped(int timeout_ms) {
+    TickType_t start = xTaskGetTickCount();
+    while (axes->is_moving) {
+        if ((xTaskGetTickCount() - start) > pdMS_TO_TICKS(timeout_ms)) {
+            axes->send({ mot_pap::HARD_STOP });
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(AUTOTUNE_SAMPLE_PERIOD_MS));
+    }
+    return true;
+}
+
+/**
+ * @brief   moves the first axis one step from origin, measuring rise time,
+ *          overshoot and settling time from the encoder samples.
+ */
+void autotune::run_trial(autotune_trial &trial, int origin) {
+    mot_pap *axis = axes->first_axis;
+    const int target = origin + distance_counts;
+    const int sign = distance_counts > 0 ? 1 : -1;
+    const int band = std::max(MOT_PAP_POS_THRESHOLD + 1, std::abs(distance_counts) / 100);
+
+    axes->kp.set_tunings(trial.gain);
+    axes->kp.set_output_limits(axes->kp.normal_out_min, trial.max_freq, axes->kp.slow_out_min, axes->kp.slow_out_max);
+
+    bresenham_msg msg;
+    msg.type = mot_pap::type::MOVE;
+    msg.first_axis_setpoint = target;
+    msg.second_axis_setpoint = axes->second_axis->current_counts;
+    axes->send(msg);
+
+    // Wait for the axes task to pick the move (brakes may delay it)
+    TickType_t wait_start = xTaskGetTickCount();
+    while (!axes->is_moving && (xTaskGetTickCount() - wait_start) < pdMS_TO_TICKS(1000)) {
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+
+    TickType_t t0 = xTaskGetTickCount();
+    TickType_t stopped_at = 0;
+    int t10 = -1, t90 = -1, last_outside = 0;
+    int pos = origin;
+
+    while (true) {
+        TickType_t now = xTaskGetTickCount();
+        int elapsed = (now - t0) * portTICK_PERIOD_MS;
+
+        axis->read_pos_from_encoder();
+        pos = axis->current_counts;
+
+        // 64 bits, (pos - origin) * 100 overflows past ~21 million counts
+        int progress = static_cast<int>((static_cast<int64_t>(pos - origin) * 100) / distance_counts);
+        if (t10 < 0 && progress >= 10) {
+            t10 = elapsed;
+        }
+        if (t90 < 0 && progress >= 90) {
+            t90 = elapsed;
+        }
+        trial.overshoot = std::max(trial.overshoot, (pos - target) * sign);
+        if (std::abs(pos - target) > band) {
+            last_outside = elapsed;
+        }
+
+        if (!axes->is_moving) {
+            if (!stopped_at) {
+                stopped_at = now;
+            } else if ((now - stopped_at) > pdMS_TO_TICKS(AUTOTUNE_HOLD_MS)) {
+                break;
+            }
+        }
+
+        if (elapsed > AUTOTUNE_MOVE_TIMEOUT_MS) {
+            axes->send({ mot_pap::HARD_STOP });
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(AUTOTUNE_SAMPLE_PERIOD_MS));
+    }
+
+    trial.stalled = axis->stalled;
+    trial.settled = std::abs(pos - target) <= band;
+    trial.rise_ms = (t10 >= 0 && t90 >= 0) ? (t90 - t10) : -1;
+    trial.settling_ms = last_outside;
+}
+
+void autotune::task([[maybe_unused]] void *pars) {
+    const float original_gain = axes->kp.kp_;
+    const int normal_min = axes->kp.normal_out_min;
+    const int normal_max = axes->kp.normal_out_max;
+    const int slow_min = axes->kp.slow_out_min;
+    const int slow_max = axes->kp.slow_out_max;
+
+    axes->first_axis->read_pos_from_encoder();
+    axes->second_axis->read_pos_from_encoder();
+    const int origin = axes->first_axis->current_counts;
+
+    for (int i = 0; i < trials_count; i++) {
+        run_trial(trials[i], origin);
+
+        // Go back to the origin with the original settings
+        axes->kp.set_tunings(original_gain);
+        axes->kp.set_output_limits(normal_min, normal_max, slow_min, slow_max);
+
+        bresenham_msg msg;
+        msg.type = mot_pap::type::MOVE;
+        msg.first_axis_setpoint = origin;
+        msg.second_axis_setpoint = axes->second_axis->current_counts;
+        axes->send(msg);
+        vTaskDelay(pdMS_TO_TICKS(AUTOTUNE_SAMPLE_PERIOD_MS));
+        wait_until_stopped(AUTOTUNE_MOVE_TIMEOUT_MS);
+
+        if (!rema::control_enabled_get()) { // Stall control disables it
+            lDebug(Warn, "%s: autotune aborted, control disabled", axes->name);
+            trials_count = i + 1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < trials_count; i++) {
+        const autotune_trial &trial = trials[i];
+        if (trial.stalled || !trial.settled || trial.overshoot > max_overshoot) {
+            continue;
+        }
+        if (best < 0 || trial.settling_ms < trials[best].settling_ms) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        // Keep the slow to normal ratios already configured for this axes group
+        proposed_normal_min = normal_min;
+        proposed_normal_max = trials[best].max_freq;
+        proposed_slow_min = slow_min;
+        proposed_slow_max = slow_max;
+        if (normal_max > 0) { // Changed by AXES_SETTINGS while running
+            proposed_slow_min = static_cast<int>(static_cast<int64_t>(slow_min) * proposed_normal_max / normal_max);
+            proposed_slow_max = static_cast<int>(static_cast<int64_t>(slow_max) * proposed_normal_max / normal_max);
+        }
+
+        if (apply) {
+            axes->kp.set_tunings(trials[best].gain);
+            axes->kp.set_output_limits(proposed_normal_min, proposed_normal_max, proposed_slow_min, proposed_slow_max);
+            applied = true;
+        }
+        lDebug(Info, "%s: autotune finished, best trial %i", axes->name, best);
+    } else {
+        lDebug(Warn, "%s: autotune finished, no acceptable trial", axes->name);
+    }
+
+    running = false;
+    vTaskDelete(NULL);
+}
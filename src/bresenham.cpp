@@ -10,7 +10,9 @@
 
 #include "bresenham.h"
 #include "debug.h"
+#include "events.h"
 #include "rema.h"
+#include "scope.h"
 
 void bresenham::task() {
     struct bresenham_msg *msg_rcv;
@@ -27,6 +29,8 @@ void bresenham::task() {
                 was_soft_stopped = false;
                 speed = msg_rcv->speed;
 
+                finish_request("SUPERSEDED"); // Only if the previous move is still running
+                request_id = msg_rcv->request_id;
                 move(msg_rcv->first_axis_setpoint, msg_rcv->second_axis_setpoint);
                 vTaskResume(supervisor_task_handle);
                 break;
@@ -101,13 +105,13 @@ void bresenham::task() {
     }
 }
 
-void bresenham::calculate() {
+void bresenham::calculate(encoders_pico::transaction *t) {
+    first_axis->set_direction(t); // May move the destination to take up backlash
+    second_axis->set_direction(t);
+
     first_axis->delta = abs(first_axis->destination_counts - first_axis->current_counts);
     second_axis->delta = abs(second_axis->destination_counts - second_axis->current_counts);
 
-    first_axis->set_direction();
-    second_axis->set_direction();
-
     error = first_axis->delta - second_axis->delta;
 
     if (first_axis->delta > second_axis->delta) {
@@ -122,17 +126,20 @@ void bresenham::move(int first_axis_setpoint, int second_axis_setpoint) {
     // calculation, thus clamp setpoints to half INT32 min and max
     first_axis_setpoint = std::clamp(first_axis_setpoint, -999999999, 999999999);
     second_axis_setpoint = std::clamp(second_axis_setpoint, -999999999, 999999999);
+    move_start_cycles = DWT->CYCCNT;
 
     if (!rema::control_enabled_get()) {
         lDebug(Warn, "Trying to move with control disabled");
+        finish_request("CONTROL_DISABLED");
         return;
     }
 
     if (has_brakes) {
         if (rema::brakes_mode != rema::brakes_mode_t::ON) {
-            rema::brakes_release();
+            rema::brakes_release(); // doesn't block, planning proceeds while the brakes release
         } else {
             lDebug(Warn, "Trying to move with brakes ON");
+            finish_request("BRAKES_ON");
             return;
         }
     }
@@ -144,17 +151,24 @@ void bresenham::move(int first_axis_setpoint, int second_axis_setpoint) {
     touching_counter = 0;
     first_axis->read_pos_from_encoder();
     second_axis->read_pos_from_encoder();
-    first_axis->set_destination_counts(first_axis_setpoint);
-    second_axis->set_destination_counts(second_axis_setpoint);
+    // Targets and directions of both axes go to the encoders in one CS frame,
+    // sent in the background while the move is planned
+    move_request.t.clear();
+    first_axis->set_destination_counts(first_axis_setpoint, &move_request.t);
+    second_axis->set_destination_counts(second_axis_setpoint, &move_request.t);
     lDebug(Info, "MOVE, %c: %i, %c: %i", first_axis->name, first_axis_setpoint, second_axis->name, second_axis_setpoint);
 
-    calculate();
-
-    if (first_axis->check_already_there() && second_axis->check_already_there()) {
-        already_there = true;
-        stop();
-        lDebug(Info, "%s: already there", name);
-    } else {
+    calculate(&move_request.t);
+    encoders->prepare(move_request);
+    move_request.ctx = this;
+    move_request.done = [](encoders_pico::request *r, BaseType_t *xHigherPriorityTaskWoken) {
+        xSemaphoreGiveFromISR(static_cast<bresenham *>(r->ctx)->move_request_done, xHigherPriorityTaskWoken);
+    };
+    xSemaphoreTake(move_request_done, 0);
+    bool submitted = encoders->submit(move_request);
+
+    bool there = first_axis->check_already_there() && second_axis->check_already_there();
+    if (!there) {
         if (!was_soft_stopped) {
             kp.restart();
             current_freq = kp.run(leader_axis->destination_counts, leader_axis->current_counts, speed);
@@ -163,10 +177,44 @@ void bresenham::move(int first_axis_setpoint, int second_axis_setpoint) {
                 (current_freq + kp.run_unattenuated(leader_axis->destination_counts, leader_axis->current_counts, speed)) / 2;
         }
         lDebug(Debug, "Control output = %i: ", current_freq);
+    }
+
+    // Steps can't start until the encoders have the new targets and directions
+    if (!submitted || xSemaphoreTake(move_request_done, pdMS_TO_TICKS(ENCODERS_PICO_REQUEST_TIMEOUT_MS)) != pdPASS ||
+        move_request.status != 0) {
+        encoders->withdraw(move_request, move_request_done);
+        stop("ENCODERS");
+        lDebug(Error, "%s: couldn't send targets to the encoders", name);
+        return;
+    }
+
+    if (there) {
+        already_there = true;
+        stop();
+        lDebug(Info, "%s: already there", name);
+    } else {
+        if (!has_brakes || rema::brakes_released()) {
+            start_step_timer();
+        } else {
+            start_pending = true; // the supervisor timebase will start it
+        }
+    }
+}
 
-        ticks_last_time = xTaskGetTickCount();
-        tmr.change_freq(current_freq);
+/**
+ * @brief   arms the step timer with the already calculated frequency
+ * @returns nothing
+ * @note    called from the axes task, or from the supervisor timebase ISR
+ *          once the brakes release time has elapsed.
+ */
+void bresenham::start_step_timer() {
+    start_pending = false;
+    tmr.change_freq(current_freq);
+    move_latency_cycles = DWT->CYCCNT - move_start_cycles;
+    if (move_latency_cycles > move_latency_max_cycles) {
+        move_latency_max_cycles = move_latency_cycles;
     }
+    scope::trigger(this, scope::MOVE_START);
 }
 
 void bresenham::step() {
@@ -189,32 +237,34 @@ void bresenham::step() {
  * @brief   supervise motor movement for stall or position reached in closed
  * loop
  * @returns nothing
- * @note    to be called by the deferred interrupt task handler
+ * @note    to be called by the deferred interrupt task handler. Every check
+ * runs at its own rate, as notified by the supervisor timebase.
  */
 void bresenham::supervise() {
     while (true) {
-        if (xSemaphoreTake(supervisor_semaphore, portMAX_DELAY) == pdPASS) {
+        uint32_t due;
+        if (xTaskNotifyWait(0, UINT32_MAX, &due, portMAX_DELAY) == pdPASS) {
 
-            first_axis->read_pos_from_encoder();
-            second_axis->read_pos_from_encoder();
+            if (due & (STALL_CHECK | CONTROL_UPDATE | TARGET_REACHED)) {
+                first_axis->read_pos_from_encoder();
+                second_axis->read_pos_from_encoder();
+            }
 
-            if (rema::stall_control) {
-                bool first_axis_stalled = first_axis->check_for_stall();   // make sure that both stall
-                bool second_axis_stalled = second_axis->check_for_stall(); // checks are executed
+            if (!is_moving) {
+                continue;
+            }
 
-                if (first_axis_stalled || second_axis_stalled) {
-                    stop();
-                    rema::control_enabled_set(false);
-                    continue;
-                }
+            if (start_pending) {
+                due &= ~(STALL_CHECK | CONTROL_UPDATE); // step timer not armed yet, brakes releasing
             }
 
-            if (rema::touch_probe_protection) {
+            if ((due & PROBE_CHECK) && rema::touch_probe_protection) {
                 if (rema::is_touch_probe_touching()) {
                     touching_counter++;
                     if (touching_counter >= touching_max_count) {
                         touching_counter = 0;
                         was_stopped_by_probe_protection = true;
+                        scope::trigger(this, scope::PROBE);
                         stop();
                         lDebug(Warn, "%s: touch probe protection", name);
                         continue;
@@ -224,25 +274,40 @@ void bresenham::supervise() {
                 }
             }
 
+            if ((due & STALL_CHECK) && rema::stall_control) {
+                bool first_axis_stalled = first_axis->check_for_stall();   // make sure that both stall
+                bool second_axis_stalled = second_axis->check_for_stall(); // checks are executed
+
+                if (first_axis_stalled || second_axis_stalled) {
+                    scope::trigger(this, scope::STALL);
+                    stop();
+                    rema::control_enabled_set(false);
+                    continue;
+                }
+            }
+
             // Watchdog is restarted every time telemetry is sent to REMA_Proxy
-            if (rema::is_watchdog_expired()) {
-                stop();
+            if ((due & WATCHDOG_CHECK) && rema::is_watchdog_expired()) {
+                stop("WATCHDOG");
                 lDebug(Info, "Watchdog expired");
                 continue;
             }
 
-            calculate(); // recalculate to compensate for encoder errors
-                         // if didn't stop for proximity to set point, avoid going to
-                         // infinity keeps dancing around the setpoint...
+            if (due & CONTROL_UPDATE) {
+                calculate(); // recalculate to compensate for encoder errors
+                             // if didn't stop for proximity to set point, avoid going to
+                             // infinity keeps dancing around the setpoint...
 
-            if (!was_soft_stopped) {
-                current_freq = kp.run(leader_axis->destination_counts, leader_axis->current_counts, speed);
-            } else {
-                current_freq =
-                    (current_freq + kp.run_unattenuated(leader_axis->destination_counts, leader_axis->current_counts, speed)) / 2;
+                if (!was_soft_stopped) {
+                    current_freq = kp.run(leader_axis->destination_counts, leader_axis->current_counts, speed);
+                } else {
+                    current_freq =
+                        (current_freq + kp.run_unattenuated(leader_axis->destination_counts, leader_axis->current_counts, speed)) / 2;
+                }
+                lDebug(Debug, "Control output = %i: ", current_freq);
+                tmr.change_freq(current_freq);
+                scope::sample(this, scope::SUPERVISOR);
             }
-            lDebug(Debug, "Control output = %i: ", current_freq);
-            tmr.change_freq(current_freq);
         }
     }
 }
@@ -252,56 +317,64 @@ void bresenham::supervise() {
  */
 void bresenham::isr() {
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-    TickType_t ticks_now = xTaskGetTickCount();
 
     already_there = first_axis->check_already_there() && second_axis->check_already_there();
     if (already_there) {
         stop();
-        xSemaphoreGiveFromISR(supervisor_semaphore, &xHigherPriorityTaskWoken);
+        xTaskNotifyFromISR(supervisor_task_handle, TARGET_REACHED, eSetBits, &xHigherPriorityTaskWoken);
         portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
         return;
     }
 
     step();
-
-    if ((ticks_now - ticks_last_time) > pdMS_TO_TICKS(step_time.count())) {
-        ticks_last_time = ticks_now;
-        xSemaphoreGiveFromISR(supervisor_semaphore, &xHigherPriorityTaskWoken);
-        portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
-    }
+    scope::sample(this, scope::ISR);
 }
 
 /**
  * @brief   if there is a movement in process, stops it
+ * @param   cause   : failure reported for the move in progress. If nullptr it
+ *                    is deduced from the flags set before stopping, STOPPED if
+ *                    none is set.
  * @returns nothing
+ * @note    callable from ISRs.
  */
-void bresenham::stop() {
+void bresenham::stop(const char *cause) {
     is_moving = false;
+    start_pending = false;
     tmr.stop();
     current_freq = 0;
     if (has_brakes) {
-        rema::brakes_apply();
+        rema::brakes_apply_after_hold();
     }
-}
 
-/**
- * @brief   if there is a movement in process, stops it
- * @returns nothing
- */
-void bresenham::pause() {
-    if (is_moving) {
-        tmr.stop();
+    if (cause == nullptr) {
+        if (was_stopped_by_probe) {
+            cause = "PROBE";
+        } else if (was_stopped_by_probe_protection) {
+            cause = "PROBE_PROTECTION";
+        } else if (first_axis->stalled || second_axis->stalled) {
+            cause = "STALLED";
+        } else if (already_there) {
+            cause = was_soft_stopped ? "SOFT_STOPPED" : nullptr; // Completed
+        } else {
+            cause = "STOPPED";
+        }
     }
+    finish_request(cause);
 }
 
 /**
- * @brief   if there was a movement in process, resume it
- * @returns nothing
+ * @brief   posts the end of the move in progress, if it has a request id
+ * @param   failure : nullptr if it completed
+ * @note    callable from ISRs, the id is taken so the end is posted only once.
  */
-void bresenham::resume() {
-    if (is_moving) {
-        tmr.start();
-    }
+void bresenham::finish_request(const char *failure) {
+    UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+    uint32_t id = request_id;
+    request_id = 0;
+    taskEXIT_CRITICAL_FROM_ISR(saved);
+
+    events::post(id, name, failure);
 }
 
 void bresenham::send(bresenham_msg msg) {
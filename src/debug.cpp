@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "spi.h"
+
 void uart_DMA_TX_task([[maybe_unused]] void *pars) {
     while (true) {           
         static char *old_debug_msg = nullptr;  
@@ -98,7 +100,8 @@ extern "C" void DMA_IRQHandler(void) {
         Chip_GPDMA_ClearIntPending(LPC_GPDMA, GPDMA_STATCLR_INTTC, 0);  // Limpiar la interrupción
     
         vTaskNotifyGiveFromISR(uart_DMA_TX_task_handle, &xHigherPriorityTaskWoken);
-
-        portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
     }
+
+    spi_dma_isr(&xHigherPriorityTaskWoken);   // Canales del SSP1 de los encoders
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
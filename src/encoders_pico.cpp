@@ -1,12 +1,15 @@
 #include "encoders_pico.h"
 
+#include <algorithm>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "FreeRTOS.h"
 #include "board.h"
 #include "semphr.h"
 #include "task.h"
+#include "timers.h"
 
 #include "debug.h"
 #include "mot_pap.h"
@@ -18,42 +21,72 @@ gpio_pinint encoders_irq_pin = {
     6, 1, (SCU_MODE_INBUFF_EN | SCU_MODE_PULLDOWN | SCU_MODE_FUNC0), 3, 0, PIN_INT0_IRQn
 }; // GPIO0 P6_1     PIN74   GPIO3[0]
 
+static const int lane_wait_ms[encoders_pico::PRIORITIES_COUNT] = {
+    ENCODERS_PICO_SAFETY_WAIT_MS, ENCODERS_PICO_MOTION_WAIT_MS, ENCODERS_PICO_TELEMETRY_WAIT_MS
+};
+
+/**
+ * @brief 	takes the lane of the priority class
+ * @param 	priority	: class of the caller
+ * @returns	false if the lane wasn't free within the bounded wait of the class
+ */
+bool encoders_pico::lane_take(enum priority priority) const {
+    if (lanes[priority] == nullptr || xSemaphoreTake(lanes[priority], pdMS_TO_TICKS(lane_wait_ms[priority])) != pdTRUE) {
+        bus_stats[priority].lane_timeouts++;
+        return false;
+    }
+    return true;
+}
+
+void encoders_pico::lane_give(enum priority priority) const {
+    xSemaphoreGive(lanes[priority]);
+}
 
 /**
  * @brief 	writes 1 byte (address or data) to the chip
  * @param 	data	: address or data to write through SPI
  * @returns	0 on success
  */
-int32_t encoders_pico::write_register(uint8_t address, int32_t data) const {
-    int32_t ret = 0;
-    if (encoders_mutex != nullptr && xSemaphoreTake(encoders_mutex, portMAX_DELAY) == pdTRUE) {
-        uint8_t write_address = address | quadrature_encoder_constants::WRITE_MASK;
-        ret = spi_write(&write_address, 1, cs);
-
-        uint8_t tx[4] = { static_cast<uint8_t>((data >> 24) & 0xFF),
-                          static_cast<uint8_t>((data >> 16) & 0xFF),
-                          static_cast<uint8_t>((data >> 8) & 0xFF),
-                          static_cast<uint8_t>((data >> 0) & 0xFF) };
-        ret = spi_write(&tx, 4, cs);
-        xSemaphoreGive(encoders_mutex);
+int32_t encoders_pico::write_register(uint8_t address, int32_t data, enum priority priority) const {
+    request r;
+    if (framed) {
+        r.t.write(address, data);
+        prepare(r);
+    } else {
+        prepare_write(r, address, data);
     }
-    return ret;
+    return run(r, spi_stats::WRITE_REGISTER, priority);
 }
 
 /**
  * @brief 	reads value from one of the RASPBERRY PI PICO ENCODERS
  * @param 	address	: address to read through SPI
+ * @param 	status	: if not nullptr, set to 0 on success
  * @returns	the value of the addressed record
  * @note	one extra register should be read because values come one
  * transfer after the address was put on the bus
  */
-int32_t encoders_pico::read_register(uint8_t address) const {
-    uint8_t rx[4] = { 0x00 };
-    if (encoders_mutex != nullptr && xSemaphoreTake(encoders_mutex, portMAX_DELAY) == pdTRUE) {
-        spi_write(&address, 1, cs);
-        spi_read(rx, 4, cs);
-        xSemaphoreGive(encoders_mutex);
+int32_t encoders_pico::read_register(
+    uint8_t address, enum priority priority, spi_stats::call_site site, int32_t *status) const {
+    request r;
+    int32_t ret;
+    if (framed) {
+        int32_t value = 0;
+        r.t.read(address, &value);
+        prepare(r);
+        ret = run(r, site, priority);
+        if (status) {
+            *status = ret;
+        }
+        return value;
+    }
+
+    prepare_read(r, address, 4);
+    ret = run(r, site, priority);
+    if (status) {
+        *status = ret;
     }
+    const uint8_t *rx = r.t.rx;
     return static_cast<int32_t>(rx[0] << 24 | rx[1] << 16 | rx[2] << 8 | rx[3] << 0);
 }
 
@@ -64,12 +97,27 @@ int32_t encoders_pico::read_register(uint8_t address) const {
  * @note	one extra register should be read because values come one
  * transfer after the address was put on the bus
  */
-void encoders_pico::read_4_registers(uint8_t address, uint8_t *rx) const {
-    if (encoders_mutex != nullptr && xSemaphoreTake(encoders_mutex, portMAX_DELAY) == pdTRUE) {
-        spi_write(&address, 1, cs);
-        spi_read(rx, 4 * 4, cs);
-        xSemaphoreGive(encoders_mutex);
+void encoders_pico::read_4_registers(uint8_t address, uint8_t *rx, enum priority priority) const {
+    request r;
+    if (framed) {
+        int32_t values[4] = { 0 };
+        for (int i = 0; i < 4; i++) {
+            r.t.read(address + i + 1, &values[i]);
+        }
+        prepare(r);
+        run(r, spi_stats::READ_4_REGISTERS, priority);
+        for (int i = 0; i < 4; i++) {
+            rx[i * 4 + 0] = static_cast<uint8_t>((values[i] >> 24) & 0xFF);
+            rx[i * 4 + 1] = static_cast<uint8_t>((values[i] >> 16) & 0xFF);
+            rx[i * 4 + 2] = static_cast<uint8_t>((values[i] >> 8) & 0xFF);
+            rx[i * 4 + 3] = static_cast<uint8_t>((values[i] >> 0) & 0xFF);
+        }
+        return;
     }
+
+    prepare_read(r, address, 4 * 4);
+    run(r, spi_stats::READ_4_REGISTERS, priority);
+    memcpy(rx, r.t.rx, 4 * 4);
 }
 
 /**
@@ -78,36 +126,673 @@ void encoders_pico::read_4_registers(uint8_t address, uint8_t *rx) const {
  * @note
  */
 struct limits encoders_pico::read_limits() const {
-    uint8_t rx[4] = { 0x00 };
-    if (encoders_mutex != nullptr && xSemaphoreTake(encoders_mutex, portMAX_DELAY) == pdTRUE) {
-        uint8_t address = quadrature_encoder_constants::LIMITS;
-        spi_write(&address, 1, cs);
-        spi_read(rx, 4, cs);
-        xSemaphoreGive(encoders_mutex);
-    }
-    return { rx[0], rx[1] };
+    int32_t value = read_register(quadrature_encoder_constants::LIMITS, TELEMETRY, spi_stats::READ_LIMITS);
+    return { static_cast<uint8_t>((value >> 24) & 0xFF), static_cast<uint8_t>((value >> 16) & 0xFF) };
 }
 
 /**
  * @brief 	reads limits. (Used in IRQ)
- * @returns	status of the limits
- * @note
+ * @param 	limits	: status of the limits, left untouched if the read failed
+ * @returns	0 on success
  */
-struct limits encoders_pico::read_limits_and_ack() const {
+int32_t encoders_pico::read_limits_and_ack(struct limits &limits) const {
     uint8_t address = quadrature_encoder_constants::LIMITS | quadrature_encoder_constants::WRITE_MASK; // will ACK the IRQ
-    uint8_t rx[4] = { 0x00 };
+    int32_t status;
+    int32_t value = read_register(address, SAFETY, spi_stats::READ_LIMITS_AND_ACK, &status);
+    if (status == 0) {
+        limits = { static_cast<uint8_t>((value >> 24) & 0xFF), static_cast<uint8_t>((value >> 16) & 0xFF) };
+    }
+    return status;
+}
+
+/**
+ * @brief 	CRC-8, polynomial 0x07
+ */
+static uint8_t crc8(const uint8_t *data, int len, uint8_t crc = 0x00) {
+    while (len--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? static_cast<uint8_t>((crc << 1) ^ 0x07) : static_cast<uint8_t>(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief 	sets up the frames for the operations of the request transaction,
+ * framed, batched or split as currently configured.
+ * @param 	r	: request with its transaction already filled
+ * @returns	nothing
+ * @note 	without the framed or batched capabilities every operation goes
+ * as an address frame followed by a data frame, as older PICO firmware expects.
+ */
+void encoders_pico::prepare(request &r) const {
+    const int len = r.t.ops_length();
+    r.framed = framed;
+    r.split = !framed && !batched;
+    if (framed) {
+        r.frames[0] = { r.t.tx, r.t.rx, static_cast<uint16_t>(transaction::FRAME_HEADER + len + transaction::FRAME_TRAILER) };
+    } else {
+        r.frames[0] = { &r.t.tx[transaction::FRAME_HEADER], &r.t.rx[transaction::FRAME_HEADER], static_cast<uint16_t>(len) };
+    }
+    r.frames_count = r.split ? r.t.ops * 2 : (len ? 1 : 0);
+}
+
+/**
+ * @brief 	frame number index of the request. Split requests take the address
+ * and then the data of each operation from the transaction, the answers of
+ * reads land where a batched frame would have put them.
+ */
+encoders_pico::request::frame encoders_pico::frame_at(request &r, int index) const {
+    if (!r.split) {
+        return r.frames[index];
+    }
+
+    const int op = index / 2;
+    const int offset = transaction::FRAME_HEADER + op * transaction::OP_SIZE;
+    if (index % 2 == 0) {
+        return { &r.t.tx[offset], nullptr, 1 };
+    }
+    if (r.t.dests[op] == nullptr) { // Write, the data follows the address
+        return { &r.t.tx[offset + 1], nullptr, 4 };
+    }
+    return { nullptr, &r.t.rx[offset + 1], 4 };
+}
+
+/**
+ * @brief 	address frame followed by the data frame, the unframed protocol
+ */
+void encoders_pico::prepare_write(request &r, uint8_t address, int32_t data) const {
+    uint8_t *tx = r.t.tx;
+    tx[0] = address | quadrature_encoder_constants::WRITE_MASK;
+    tx[1] = static_cast<uint8_t>((data >> 24) & 0xFF);
+    tx[2] = static_cast<uint8_t>((data >> 16) & 0xFF);
+    tx[3] = static_cast<uint8_t>((data >> 8) & 0xFF);
+    tx[4] = static_cast<uint8_t>((data >> 0) & 0xFF);
+    r.frames[0] = { &tx[0], nullptr, 1 };
+    r.frames[1] = { &tx[1], nullptr, 4 };
+    r.frames_count = 2;
+    r.framed = false;
+    r.split = false;
+}
+
+/**
+ * @brief 	address frame followed by the frame clocking the answer into
+ * r.t.rx, the unframed protocol
+ */
+void encoders_pico::prepare_read(request &r, uint8_t address, int len) const {
+    r.t.tx[0] = address;
+    r.frames[0] = { &r.t.tx[0], nullptr, 1 };
+    r.frames[1] = { nullptr, r.t.rx, static_cast<uint16_t>(len) };
+    r.frames_count = 2;
+    r.framed = false;
+    r.split = false;
+}
+
+/**
+ * @brief 	stamps a new sequence and the request CRC on a framed request
+ */
+void encoders_pico::seal(request &r) const {
+    const int len = r.t.ops_length();
+    uint8_t *trailer = &r.t.tx[transaction::FRAME_HEADER + len];
+    r.t.tx[0] = ++frame_seq;
+    trailer[0] = crc8(r.t.tx, transaction::FRAME_HEADER + len);
+    trailer[1] = trailer[2] = 0;
+    link_stats.frames++;
+}
+
+/**
+ * @brief 	turns the reads that ACK the limits IRQ into plain limits reads
+ * before a retry. The failed attempt may have ACKed already, if it didn't the
+ * IRQ line stays up and the task reads and ACKs the limits again.
+ */
+void encoders_pico::drop_acks(request &r) const {
+    const uint8_t ack = quadrature_encoder_constants::LIMITS | quadrature_encoder_constants::WRITE_MASK;
+    for (int i = 0; i < r.t.ops; i++) {
+        uint8_t &address = r.t.tx[transaction::FRAME_HEADER + i * transaction::OP_SIZE];
+        if (r.t.dests[i] && address == ack) {
+            address = quadrature_encoder_constants::LIMITS;
+        }
+    }
+}
+
+/**
+ * @brief 	verifies the echoed sequence and the response CRC
+ * @returns	true if the response can be trusted
+ */
+bool encoders_pico::check(request &r) const {
+    const int len = r.t.ops_length();
+    const uint8_t *response = &r.t.rx[transaction::FRAME_HEADER];
+    if (response[len + 1] != r.t.tx[0]) {
+        link_stats.seq_errors++;
+        return false;
+    }
+    if (crc8(response, len + 2) != response[len + 2]) {
+        link_stats.crc_errors++;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 	starts the current frame of the active request
+ * @note 	called with the DMA interrupt masked or from it.
+ */
+void encoders_pico::start_frame() const {
+    request &r = *active;
+    const request::frame f = frame_at(r, r.frame_index);
+    if (r.frame_index == 0 && r.attempt == 0) {
+        r.started = DWT->CYCCNT;
+    }
+    if (r.framed && r.frame_index == 0) {
+        seal(r);
+    }
+    cs(0);
+    spi_guard_delay();
+    frame_start(f.tx, f.rx, f.length);
+}
+
+#ifdef SIMULATE_ENCODER
+/**
+ * @brief 	emulated transport, the emulator answers the frame right away and
+ * its completion is deferred to the timer task, the way the DMA interrupt
+ * comes after the transfer. Completing it here would complete a request
+ * before submit() returned, which then completes it again.
+ */
+void encoders_pico::emulator_frame_start(const uint8_t *tx, uint8_t *rx, uint16_t len) {
+    static const uint8_t dummy[SSP_DMA_MAX_LENGTH] = { 0 };
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    encoders_emulator.frame(tx ? tx : dummy, rx, len);
+    // Only one frame is in flight, the timer queue always has room for it
+    xTimerPendFunctionCallFromISR(emulator_frame_done, nullptr, ++emulator_frame_id, &xHigherPriorityTaskWoken);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+/**
+ * @brief 	emulated DMA interrupt, runs on the timer task
+ * @param 	frame_id	: emulator_frame_id of the frame, stale after a withdraw()
+ */
+void encoders_pico::emulator_frame_done([[maybe_unused]] void *pars, uint32_t frame_id) {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR(); // Masked like the DMA interrupt against submit()
+    if (frame_id == emulator_frame_id && encoders->active) {
+        dma_done_isr(&xHigherPriorityTaskWoken);
+    }
+    taskEXIT_CRITICAL_FROM_ISR(saved);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+#endif
+
+/**
+ * @brief 	queues a request behind the ones of its class. When all the
+ * ENCODERS_PICO_QUEUE_LENGTH slots are taken the newest request of the lowest
+ * class below it is preempted to make room.
+ * @param 	r		: request to queue
+ * @param 	preempted	: set to the dropped request, if any
+ * @returns	false if there was no room for the request
+ * @note 	called inside a critical section.
+ */
+bool encoders_pico::enqueue(request &r, request **preempted) const {
+    int queued = 0;
+    for (int p = 0; p < PRIORITIES_COUNT; p++) {
+        queued += pending_count[p];
+    }
+
+    if (queued >= ENCODERS_PICO_QUEUE_LENGTH) {
+        int victim = PRIORITIES_COUNT - 1;
+        while (victim > r.priority && pending_count[victim] == 0) {
+            victim--;
+        }
+        if (victim <= r.priority) {
+            return false;
+        }
+        int tail = (pending_head[victim] + --pending_count[victim]) % ENCODERS_PICO_QUEUE_LENGTH;
+        *preempted = pending[victim][tail];
+        bus_stats[victim].preempted++;
+    }
+
+    pending[r.priority][(pending_head[r.priority] + pending_count[r.priority]++) % ENCODERS_PICO_QUEUE_LENGTH] = &r;
+    return true;
+}
+
+/**
+ * @brief 	oldest queued request of the highest class
+ * @returns	nullptr if nothing is queued
+ * @note 	called inside a critical section.
+ */
+encoders_pico::request *encoders_pico::dequeue() const {
+    for (int p = 0; p < PRIORITIES_COUNT; p++) {
+        if (pending_count[p]) {
+            request *r = pending[p][pending_head[p]];
+            pending_head[p] = (pending_head[p] + 1) % ENCODERS_PICO_QUEUE_LENGTH;
+            pending_count[p]--;
+            return r;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @brief 	queues a request, starting it right away if the bus is idle
+ * @param 	r	: prepared request
+ * @returns	false if the queues are full of requests of the same or higher
+ * classes
+ * @note 	callable from ISRs, done callbacks can chain requests.
+ */
+bool encoders_pico::submit(request &r) const {
+    r.frame_index = 0;
+    r.attempt = 0;
+    r.status = 0;
+    r.completed = false;
+
+    bool queued = true;
+    request *preempted = nullptr;
+    UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+    bus_stats[r.priority].requests++;
+    if (r.frames_count == 0) {
+        r.started = r.finished = DWT->CYCCNT;
+        r.completed = true; // Nothing to send, completes right away
+    } else if (active == nullptr) {
+        active = &r;
+        start_frame();
+    } else if (!enqueue(r, &preempted)) {
+        bus_stats[r.priority].rejected++;
+        queued = false;
+    }
+    if (preempted) {
+        preempted->status = -2;
+        preempted->completed = true;
+    }
+    taskEXIT_CRITICAL_FROM_ISR(saved);
+
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    if (preempted && preempted->done) {
+        preempted->done(preempted, &xHigherPriorityTaskWoken);
+    }
+    if (r.completed && r.done) {
+        r.done(&r, &xHigherPriorityTaskWoken);
+    }
+    return queued;
+}
+
+/**
+ * @brief 	drops a request that didn't complete in time from its queue
+ * @returns	false if its frames are already on the bus. They are let finish,
+ * cutting an unframed address from its data frame would make the PICO take
+ * the next address as data. The caller must wait for the completion.
+ */
+bool encoders_pico::cancel(request &r) const {
+    bool dropped = true;
+    taskENTER_CRITICAL();
+    if (active == &r) {
+        dropped = false;
+    } else {
+        request **queue = pending[r.priority];
+        const int head = pending_head[r.priority];
+        int &count = pending_count[r.priority];
+        for (int i = 0; i < count; i++) {
+            if (queue[(head + i) % ENCODERS_PICO_QUEUE_LENGTH] == &r) {
+                for (int j = i; j < count - 1; j++) {
+                    queue[(head + j) % ENCODERS_PICO_QUEUE_LENGTH] = queue[(head + j + 1) % ENCODERS_PICO_QUEUE_LENGTH];
+                }
+                count--;
+                break;
+            }
+        }
+    }
+    taskEXIT_CRITICAL();
+    return dropped;
+}
 
-    if (encoders_mutex != nullptr && xSemaphoreTake(encoders_mutex, portMAX_DELAY) == pdTRUE) {
-        spi_write(&address, 1, cs);
-        spi_read(rx, 4, cs);
-        xSemaphoreGive(encoders_mutex);
+/**
+ * @brief 	takes a request that didn't complete in time off the bus, so it can
+ * go out of scope or be reused
+ * @param 	r	: request given up on
+ * @param 	done	: semaphore its done callback gives
+ * @note 	active requests get another ENCODERS_PICO_REQUEST_TIMEOUT_MS to
+ * finish. Only a stuck transfer is stopped halfway, the bus is broken then.
+ */
+void encoders_pico::withdraw(request &r, SemaphoreHandle_t done) const {
+    if (cancel(r) || xSemaphoreTake(done, pdMS_TO_TICKS(ENCODERS_PICO_REQUEST_TIMEOUT_MS)) == pdPASS) {
+        return;
+    }
+
+    taskENTER_CRITICAL();
+    if (active == &r) {
+        spi_dma_stop();
+        cs(1);
+        active = dequeue();
+        if (active) {
+            start_frame();
+        }
+    }
+    taskEXIT_CRITICAL();
+    lDebug(Error, "Encoders transfer stuck, stopped");
+}
+
+/**
+ * @brief 	SSP reception DMA completion, advances the active request to its
+ * next frame, retries it or completes it and starts the next queued one.
+ */
+void encoders_pico::dma_done_isr(BaseType_t *xHigherPriorityTaskWoken) {
+    const encoders_pico &e = *encoders;
+    request *r = e.active;
+    if (r == nullptr) {
+        xSemaphoreGiveFromISR(spi_dma_done_semaphore, xHigherPriorityTaskWoken); // spi_sync_transfer() DMA path
+        return;
+    }
+
+    Chip_SSP_Int_FlushData(LPC_SSP);
+    spi_guard_delay();
+    e.cs(1);
+    spi_guard_delay();
+
+    if (++r->frame_index < r->frames_count) {
+        e.start_frame();
+        return;
+    }
+
+    if (r->framed && !e.check(*r)) {
+        if (r->attempt++ < ENCODERS_PICO_FRAME_RETRIES) {
+            e.link_stats.retries++;
+            e.drop_acks(*r);
+            r->frame_index = 0;
+            e.start_frame();
+            return;
+        }
+        e.link_stats.failures++;
+        r->status = -1;
+    }
+
+    // Destinations are left untouched if a framed request failed
+    for (int i = 0; r->status == 0 && i < r->t.ops; i++) {
+        if (r->t.dests[i]) {
+            const uint8_t *rx = &r->t.rx[transaction::FRAME_HEADER + i * transaction::OP_SIZE + 1];
+            *r->t.dests[i] = static_cast<int32_t>(rx[0] << 24 | rx[1] << 16 | rx[2] << 8 | rx[3] << 0);
+        }
+    }
+
+    // A limits IRQ request queued meanwhile goes before older motion and telemetry ones
+    e.active = e.dequeue();
+    if (e.active) {
+        e.start_frame();
+    }
+
+    r->finished = DWT->CYCCNT;
+    r->completed = true;
+    if (r->done) {
+        r->done(r, xHigherPriorityTaskWoken);
+    }
+}
+
+/**
+ * @brief 	runs the request frames on the calling task, used before the
+ * scheduler starts.
+ */
+int32_t encoders_pico::run_polled(request &r) const {
+    r.started = DWT->CYCCNT;
+    for (r.attempt = 0; r.attempt <= ENCODERS_PICO_FRAME_RETRIES; r.attempt++) {
+        if (r.framed) {
+            seal(r);
+        }
+        for (int i = 0; i < r.frames_count; i++) {
+            const request::frame f = frame_at(r, i);
+#ifdef SIMULATE_ENCODER
+            static const uint8_t dummy[SSP_DMA_MAX_LENGTH] = { 0 };
+            encoders_emulator.frame(f.tx ? f.tx : dummy, f.rx, f.length);
+#else
+            Chip_SSP_DATA_SETUP_T xfer = { .tx_data = const_cast<uint8_t *>(f.tx),
+                                           .tx_cnt = 0,
+                                           .rx_data = f.rx,
+                                           .rx_cnt = 0,
+                                           .length = f.length };
+            spi_sync_transfer(&xfer, cs);
+#endif
+        }
+        if (!r.framed || check(r)) {
+            r.status = 0;
+            break;
+        }
+        r.status = -1;
+        drop_acks(r);
+    }
+
+    for (int i = 0; r.status == 0 && i < r.t.ops; i++) {
+        if (r.t.dests[i]) {
+            const uint8_t *rx = &r.t.rx[transaction::FRAME_HEADER + i * transaction::OP_SIZE + 1];
+            *r.t.dests[i] = static_cast<int32_t>(rx[0] << 24 | rx[1] << 16 | rx[2] << 8 | rx[3] << 0);
+        }
+    }
+    r.finished = DWT->CYCCNT;
+    r.completed = true;
+    return r.status;
+}
+
+/**
+ * @brief 	blocking wrapper over submit(). Blocking callers of the same class
+ * take turns on its lane and sleep on its blocking_done semaphore while the
+ * request is processed, callers of different classes only meet in the queues.
+ * @returns	0 on success
+ * @note 	the call site gets the wait, lane and queue, until the first frame
+ * starts and the transfer, from then until the last frame completes.
+ */
+int32_t encoders_pico::run(request &r, spi_stats::call_site site, enum priority priority) const {
+    int32_t ret = -1;
+    const uint32_t start = DWT->CYCCNT;
+    if (!lane_take(priority)) {
+        lDebug(Error, "Encoders %s lane busy", priority_names[priority]);
+        return ret;
+    }
+
+    r.priority = priority;
+    if (xTaskGetSchedulerState() != taskSCHEDULER_RUNNING) {
+        ret = run_polled(r);
+    } else {
+        r.ctx = blocking_done[priority];
+        r.done = [](request *r, BaseType_t *xHigherPriorityTaskWoken) {
+            xSemaphoreGiveFromISR(static_cast<SemaphoreHandle_t>(r->ctx), xHigherPriorityTaskWoken);
+        };
+        xSemaphoreTake(blocking_done[priority], 0); // Drop a completion left by a cancelled request
+        if (submit(r) &&
+            xSemaphoreTake(blocking_done[priority], pdMS_TO_TICKS(ENCODERS_PICO_REQUEST_TIMEOUT_MS)) == pdPASS) {
+            ret = r.status;
+        } else {
+            withdraw(r, blocking_done[priority]);
+            lDebug(Error, "Encoders request timed out");
+        }
+    }
+
+    if (r.completed && r.status != -2) {
+        spi_stats::wait[site].record(r.started - start);
+        spi_stats::transfer[site].record(r.finished - r.started);
+    }
+
+    lane_give(priority);
+    return ret;
+}
+
+/**
+ * @brief 	executes all the operations of the transaction, in a single CS frame
+ * if the PICO firmware supports framed or batched transactions
+ * @param 	t	: transaction, read operations get their destinations filled
+ * @param 	site	: caller, for the SPI statistics
+ * @param 	priority	: bus arbitration class
+ * @returns	0 on success
+ * @note 	destinations are left untouched if a framed transaction fails.
+ */
+int32_t encoders_pico::execute(transaction &t, spi_stats::call_site site, enum priority priority) const {
+    if (t.empty()) {
+        return 0;
+    }
+
+    request r;
+    r.t = t;
+    prepare(r);
+    int32_t ret = run(r, site, priority);
+    t.ops = 0;
+    return ret;
+}
+
+/**
+ * @brief 	reads all counters and the limits in one frame and publishes them
+ * @returns	false if the read failed, the previous snapshot is kept then
+ */
+bool encoders_pico::sample() {
+    struct encoders_snapshot s = {};
+    int32_t limits_reg = 0;
+
+    transaction t;
+    for (int i = 0; i < ENCODERS_PICO_COUNTERS; i++) {
+        t.read(quadrature_encoder_constants::COUNTERS + i + 1, &s.counters[i]);
+    }
+    t.read(quadrature_encoder_constants::LIMITS, &limits_reg);
+    if (execute(t) != 0) {
+        sample_failures++;
+        return false;
+    }
+
+    s.limits = { static_cast<uint8_t>((limits_reg >> 24) & 0xFF), static_cast<uint8_t>((limits_reg >> 16) & 0xFF) };
+    s.ticks = xTaskGetTickCount();
+    s.cycles = DWT->CYCCNT;
+
+    // Both the sampling task and the limits IRQ task publish
+    taskENTER_CRITICAL();
+    snapshot_lock.write(s);
+    taskEXIT_CRITICAL();
+    return true;
+}
+
+/**
+ * @brief 	publishes limits read by the IRQ path, counters are left untouched
+ * @returns	nothing
+ */
+void encoders_pico::publish_limits(struct limits limits) {
+    taskENTER_CRITICAL();
+    snapshot_lock.update([limits](struct encoders_snapshot &s) { s.limits = limits; });
+    taskEXIT_CRITICAL();
+}
+
+// POS_THRESHOLDS and the registers of the unused W axis
+static const uint8_t calibration_registers[ENCODERS_PICO_CALIBRATION_REGISTERS] = {
+    quadrature_encoder_constants::POS_THRESHOLDS,
+    quadrature_encoder_constants::COUNTERS + 4,
+    quadrature_encoder_constants::TARGETS + 4,
+    quadrature_encoder_constants::DIRECTIONS + 4,
+};
+
+/**
+ * @brief 	reads the calibration registers back and compares them with the
+ * reference read at SSP_DEFAULT_BITRATE
+ * @param 	reference	: expected values of calibration_registers
+ * @param 	transfers	: transactions to try
+ * @returns	number of transactions that failed, came back different or had
+ * to be retried
+ */
+int encoders_pico::readback_errors(const int32_t *reference, int transfers) {
+    const uint32_t retries = link_stats.retries;
+    int errors = 0;
+    for (int i = 0; i < transfers; i++) {
+        int32_t values[ENCODERS_PICO_CALIBRATION_REGISTERS] = { 0 };
+        transaction t;
+        for (int r = 0; r < ENCODERS_PICO_CALIBRATION_REGISTERS; r++) {
+            t.read(calibration_registers[r], &values[r]);
+        }
+        if (execute(t, spi_stats::TRANSACTION, TELEMETRY) != 0 || memcmp(values, reference, sizeof(values))) {
+            errors++;
+        }
+    }
+    return errors + static_cast<int>(link_stats.retries - retries);
+}
+
+/**
+ * @brief 	finds the highest SSP bitrate without errors on this cable, applies
+ * ENCODERS_PICO_CALIBRATION_MARGIN to it and then trims the CS guard time to
+ * the shortest one still without errors, widened by the same margin.
+ * @returns	false if it didn't run, the bus is left at SSP_DEFAULT_BITRATE
+ * @note 	only reads, and only framed ones: a request corrupted at a bitrate
+ * being tried is rejected by its CRC instead of turning into a write. Sampling
+ * is paused meanwhile, axes must not be moving.
+ */
+bool encoders_pico::calibrate_bus() {
+    static const uint32_t bitrates[] = { 5000 * 1000, 8000 * 1000, 10000 * 1000, 12000 * 1000,
+                                         15000 * 1000, 20000 * 1000, 25000 * 1000 };
+
+    if (!framed) {
+        lDebug(Warn, "Encoders bus calibration needs framed transactions, keeping %u Hz", spi_bitrate);
+        return false;
+    }
+
+    xSemaphoreTake(sampling_lock, portMAX_DELAY);
+
+    spi_set_bitrate(SSP_DEFAULT_BITRATE);
+    spi_guard_us = SSP_DEFAULT_GUARD_US;
+
+    int32_t reference[ENCODERS_PICO_CALIBRATION_REGISTERS] = { 0 };
+    transaction t;
+    for (int r = 0; r < ENCODERS_PICO_CALIBRATION_REGISTERS; r++) {
+        t.read(calibration_registers[r], &reference[r]);
+    }
+
+    max_good_bitrate = 0;
+    if (execute(t, spi_stats::TRANSACTION, TELEMETRY) == 0) {
+        for (uint32_t bitrate : bitrates) {
+            spi_set_bitrate(bitrate);
+            if (readback_errors(reference, ENCODERS_PICO_CALIBRATION_TRANSFERS)) {
+                break;
+            }
+            max_good_bitrate = bitrate;
+        }
+    }
+
+    if (max_good_bitrate == 0) {
+        spi_set_bitrate(SSP_DEFAULT_BITRATE);
+        xSemaphoreGive(sampling_lock);
+        lDebug(Error, "Encoders bus calibration failed, keeping %u Hz", SSP_DEFAULT_BITRATE);
+        return true;
+    }
+
+    spi_set_bitrate(std::max(static_cast<uint32_t>(SSP_DEFAULT_BITRATE),
+                             max_good_bitrate / 100 * ENCODERS_PICO_CALIBRATION_MARGIN));
+
+    min_good_guard_us = SSP_DEFAULT_GUARD_US;
+    for (int guard = SSP_DEFAULT_GUARD_US - 1; guard >= 0; guard--) {
+        spi_guard_us = guard;
+        if (readback_errors(reference, ENCODERS_PICO_CALIBRATION_TRANSFERS)) {
+            break;
+        }
+        min_good_guard_us = guard;
+    }
+    // Same margin, rounded up
+    spi_guard_us = std::min(SSP_DEFAULT_GUARD_US, min_good_guard_us * 100 / ENCODERS_PICO_CALIBRATION_MARGIN + 1);
+
+    xSemaphoreGive(sampling_lock);
+    lDebug(Info, "Encoders bus at %u Hz (max %u Hz), guard %i us", spi_bitrate, max_good_bitrate, spi_guard_us);
+    return true;
+}
+
+void encoders_pico::sampling_task([[maybe_unused]] void *pars) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while (true) {
+        xSemaphoreTake(encoders->sampling_lock, portMAX_DELAY); // Paused while calibrating
+        encoders->sample();
+        xSemaphoreGive(encoders->sampling_lock);
+#ifdef SIMULATE_ENCODER
+        if (encoders_emulator.irq()) { // Level IRQ line of the emulated board
+            xSemaphoreGive(encoders_pico_semaphore);
+        }
+#endif
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(std::max(encoders->sampling_period_ms, 1)));
     }
-    return { rx[0], rx[1] };
 }
 
 void encoders_pico::task([[maybe_unused]] void *pars) {
+    encoders->calibrate_bus();
     encoders->set_thresholds(MOT_PAP_POS_THRESHOLD);
 
+    // Start sampling once the bus is calibrated
+    xTaskCreate(encoders_pico::sampling_task, "encoders_sampling", 256, NULL, ENCODERS_PICO_SAMPLING_TASK_PRIORITY, NULL);
+    lDebug(Info, "encoders_sampling_task created");
+
     NVIC_SetPriority(PIN_INT0_IRQn, ENCODERS_PICO_INTERRUPT_PRIORITY);
     encoders_irq_pin.init_input().mode_level().int_high();
 
@@ -118,32 +803,28 @@ void encoders_pico::task([[maybe_unused]] void *pars) {
     
     while (true) {
         if (xSemaphoreTake(encoders_pico_semaphore, portMAX_DELAY) == pdPASS) {
-            struct limits limits = encoders->read_limits_and_ack();
+            struct limits limits;
+            if (encoders->read_limits_and_ack(limits) != 0) {
+                // Limits and targets unknown, nothing is published nor flagged. The read
+                // may have ACKed the IRQ anyway, so it is retried instead of waiting for the line
+                lDebug(Warn, "Encoders limits read failed, retrying");
+                vTaskDelay(pdMS_TO_TICKS(1));
+                xSemaphoreGive(encoders_pico_semaphore);
+                encoders_irq_pin.clear_pending().enable();
+                continue;
+            }
+
+            encoders->publish_limits(limits);
             if (limits.hard & ENABLED_INPUTS_MASK) {
-                rema::hard_limits_reached();
+                rema::hard_limits_reached(limits.hard & ENABLED_INPUTS_MASK);
             }
 
+            // Each axis is flagged on its own, the step ISR stops the group
+            // once all of its axes are there
             x_y_axes->first_axis->already_there = limits.targets & (1 << 0);
             x_y_axes->second_axis->already_there = limits.targets & (1 << 1);
-            
-            if (x_y_axes->first_axis->already_there && x_y_axes->second_axis->already_there) {
-                x_y_axes->already_there = true;
-                x_y_axes->stop();
-                lDebug(Info, "%s: already there", x_y_axes->name);
-            } else {
-                x_y_axes->resume(); // Motors were paused by ISR to be able to read
-                                    // encoders information
-            }
-
             z_dummy_axes->first_axis->already_there = limits.targets & (1 << 2);
-            if (z_dummy_axes->first_axis->already_there) {
-                z_dummy_axes->already_there = true;
-                z_dummy_axes->stop();
-                lDebug(Info, "%s: already there", z_dummy_axes->name);
-            } else {
-                z_dummy_axes->resume(); // Motors were paused by ISR to be able to read
-                                        // encoders information
-            }
+
             //Chip_PININT_ClearIntStatus(LPC_GPIO_PIN_INT, PININTCH(0));
             encoders_irq_pin.clear_pending().enable();
         }
@@ -153,8 +834,7 @@ void encoders_pico::task([[maybe_unused]] void *pars) {
 // IRQ Handler for Raspberry Pi Pico Encoders Reader...
 extern "C" void GPIO0_IRQHandler(void) {
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-    x_y_axes->pause();
-    z_dummy_axes->pause();
+    // Axes keep moving while the task reads the status, only the affected ones get stopped
     xSemaphoreGiveFromISR(encoders_pico_semaphore, &xHigherPriorityTaskWoken);
     encoders_irq_pin.disable();                     // Otherwise IRQHandler will be called again immediately
                                                     // Reenabled at the end of encoders_pico::task
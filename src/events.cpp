@@ -0,0 +1,58 @@
+#include "events.h"
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "board.h"
+#include "queue.h"
+
+#include "supervisor_timebase.h"
+
+QueueHandle_t events::queue = nullptr;
+volatile uint32_t events::dropped = 0;
+
+void events::init() {
+    queue = xQueueCreate(EVENTS_QUEUE_SIZE, sizeof(struct event));
+}
+
+/**
+ * @brief   timestamps and queues the end of an action
+ * @param   id      : request id, nothing is posted for 0
+ * @param   source  : what ended, must be a string literal or outlive the queue
+ * @param   failure : reason it failed, nullptr if it completed
+ * @returns false if the queue was full
+ */
+bool events::post(uint32_t id, const char *source, const char *failure) {
+    if (id == 0 || queue == nullptr) {
+        return true;
+    }
+
+    struct event e = { id, source, failure, supervisor_timebase::millis(), DWT->CYCCNT };
+
+    BaseType_t queued;
+    if (xPortIsInsideInterrupt()) {
+        BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+        queued = xQueueSendFromISR(queue, &e, &xHigherPriorityTaskWoken);
+        portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+    } else {
+        queued = xQueueSend(queue, &e, 0);
+    }
+
+    if (queued != pdPASS) {
+        dropped++;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief   takes the oldest event without blocking
+ * @returns false if there was none
+ */
+bool events::receive(struct event &e) {
+    return queue != nullptr && xQueueReceive(queue, &e, 0) == pdPASS;
+}
+
+bool events::pending() {
+    return queue != nullptr && uxQueueMessagesWaiting(queue) > 0;
+}
@@ -23,6 +23,8 @@
 #include "tcp_server_command.h"
 #include "tcp_server_telemetry.h"
 #include "tcp_server_logs.h"
+#include "tcp_server_scope.h"
+#include "udp_telemetry.h"
 #include "xy_axes.h"
 #include "z_axis.h"
 
@@ -101,6 +103,12 @@ void vStackIpSetup(void *pvParameters) {
     tcp_server_command cmd(settings::network.port);
     tcp_server_telemetry tlmtry(settings::network.port + 1);
     tcp_server_logs logs(settings::network.port + 2);
+    tcp_server_scope scope_dump(settings::network.port + 3);
+    cmd.start();
+    tlmtry.start();
+    logs.start();
+    scope_dump.start();
+    udp_telemetry::start();
 
     /* This loop monitors the PHY link and will handle cable events
      via the PHY driver. */
@@ -131,8 +139,8 @@ void vStackIpSetup(void *pvParameters) {
                 tcpip_callback_with_block((tcpip_callback_fn)netif_set_link_up, reinterpret_cast<void *>(&lpc_netif), 1);
                 lDebug(Info, "Ethernet link status: CONNECTED");
             } else {
-                z_dummy_axes->stop();
-                x_y_axes->stop();
+                z_dummy_axes->stop("LINK_DOWN");
+                x_y_axes->stop("LINK_DOWN");
                 tcpip_callback_with_block((tcpip_callback_fn)netif_set_link_down, reinterpret_cast<void *>(&lpc_netif), 1);
                 lDebug(Warn, "Ethernet link status: DISCONNECTED. Motors have been stopped");
             }
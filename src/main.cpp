@@ -17,12 +17,14 @@
 
 #include "debug.h"
 #include "encoders_pico.h"
+#include "events.h"
 #include "lwip/ip_addr.h"
 #include "lwip_init.h"
 #include "mem_check.h"
 #include "mot_pap.h"
 #include "rema.h"
 #include "settings.h"
+#include "supervisor_timebase.h"
 #include "temperature_ds18b20.h"
 #include "xy_axes.h"
 #include "z_axis.h"
@@ -79,9 +81,11 @@ int main(void) {
 
     settings::init();
 
+    events::init();
     rema::init_input_outputs();
     xy_axes_init();
     z_axis_init();
+    supervisor_timebase::init();
     encoders_pico_init();
 
     temperature_ds18b20_init();
@@ -23,19 +23,35 @@ enum mot_pap::direction mot_pap::direction_calculate(int error) {
     }
 }
 
-void mot_pap::set_direction(enum direction direction) {
+/**
+ * @brief   sets the direction of movement. On a reversal the backlash is
+ *          taken up by moving the compensated target further in the new
+ *          direction.
+ * @param   direction : new direction
+ */
+void mot_pap::set_direction(enum direction direction, encoders_pico::transaction *t) {
+    if (compensation.backlash && last_dir != direction::NONE && direction != last_dir) {
+        int sign = (direction == direction_calculate(1)) ? 1 : -1;
+        backlash_offset += sign * compensation.backlash;
+        set_destination_counts(requested_counts, t);
+    }
+    last_dir = direction;
+
     dir = direction;
     if (is_dummy) {
         return;
     }
     // gpios.direction.set(dir == direction::CW ? 0 : 1);
-    encoders->set_direction(name, dir == direction::CW ? 0 : 1);
+    encoders->set_direction(name, dir == direction::CW ? 0 : 1, t);
     // lDebug_uart_semihost(Info, "%c, %s", name, (dir == direction::CW ? "+" : "-"));
 }
 
-void mot_pap::set_direction() {
-    dir = direction_calculate(destination_counts - current_counts);
-    set_direction(dir);
+void mot_pap::set_direction(encoders_pico::transaction *t) {
+    int error = destination_counts - current_counts;
+    if (std::abs(error) < MOT_PAP_POS_THRESHOLD) {
+        return; // On target, keep the direction so no reversal is detected
+    }
+    set_direction(direction_calculate(error), t);
 }
 
 bool mot_pap::check_for_stall() {
@@ -44,6 +60,10 @@ bool mot_pap::check_for_stall() {
     }
 
     const int expected_counts = ((half_pulses_stall >> 1) * encoder_resolution / motor_resolution);
+    if (expected_counts < MOT_PAP_STALL_MIN_EXPECTED_COUNTS) {
+        return false; // keep accumulating, the check runs faster than the pulses at low rates
+    }
+
     const int pos_diff = std::abs((int)(current_counts - last_pos));
 
     if (pos_diff < expected_counts) {
@@ -73,7 +93,7 @@ void mot_pap::read_pos_from_encoder() {
         return;
     }
 
-    int counts = encoders->read_counter(name);
+    int counts = encoders->snapshot().counters[name - 'X'];
     current_counts = reversed_encoder ? -counts : counts;
 }
 
@@ -101,12 +121,15 @@ void mot_pap::update_position() {
 
 #ifdef SIMULATE_ENCODER
 /**
- * @brief   updates the current position from the step counter
+ * @brief   feeds the step pulses to the emulated encoders board, the position
+ *          comes back through the snapshot as it does from the real one
  */
 void mot_pap::update_position_simulated() {
     int ratio = motor_resolution / encoder_resolution;
     if (!((half_pulses) % (ratio << 1))) {
-        update_position();
+        // Same sense as update_position(), in encoder counts
+        int counts = (reversed_direction == (dir == direction::CW)) ? 1 : -1;
+        encoders_emulator.move(name - 'X', reversed_encoder ? -counts : counts);
     }
 }
 #endif
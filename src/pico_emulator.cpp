@@ -0,0 +1,210 @@
+#include "pico_emulator.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace qec = quadrature_encoder_constants;
+
+static const int OP_SIZE = 5;
+static const int FRAME_HEADER = 1;
+static const int FRAME_TRAILER = 3;
+
+/**
+ * @brief   CRC-8, polynomial 0x07, same as encoders_pico
+ */
+static uint8_t crc8(const uint8_t *data, int len, uint8_t crc = 0x00) {
+    while (len--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? static_cast<uint8_t>((crc << 1) ^ 0x07) : static_cast<uint8_t>(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static int32_t be32(const uint8_t *p) {
+    return static_cast<int32_t>(static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+                                static_cast<uint32_t>(p[2]) << 8 | static_cast<uint32_t>(p[3]) << 0);
+}
+
+static void put_be32(uint8_t *p, int32_t value) {
+    p[0] = static_cast<uint8_t>((value >> 24) & 0xFF);
+    p[1] = static_cast<uint8_t>((value >> 16) & 0xFF);
+    p[2] = static_cast<uint8_t>((value >> 8) & 0xFF);
+    p[3] = static_cast<uint8_t>((value >> 0) & 0xFF);
+}
+
+/**
+ * @brief   axis of a per axis register, registers are base + axis + 1
+ * @returns axis index, or -1 if the register doesn't belong to this bank
+ */
+int pico_emulator::axis_of(uint8_t reg, uint8_t base) {
+    if (reg > base && reg <= base + PICO_EMULATOR_AXES) {
+        return reg - base - 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief   one CS frame, full duplex
+ * @param   tx  : bytes sent by the master
+ * @param   rx  : bytes answered, may be nullptr
+ * @param   len : frame length
+ */
+void pico_emulator::frame(const uint8_t *tx, uint8_t *rx, int len) {
+    uint8_t scratch[64];
+    if (rx == nullptr || len > static_cast<int>(sizeof(scratch))) {
+        rx = scratch;
+        len = len > static_cast<int>(sizeof(scratch)) ? static_cast<int>(sizeof(scratch)) : len;
+    }
+    memset(rx, 0, len);
+    frames++;
+
+    if (pending_address >= 0) { // Data frame of the unframed protocol
+        uint8_t address = static_cast<uint8_t>(pending_address);
+        pending_address = -1;
+        if ((address & qec::WRITE_MASK) && (address & ~qec::WRITE_MASK) != qec::LIMITS) {
+            if (len >= 4) {
+                write(address, be32(tx));
+            }
+        } else if (len == 4 * 4 && (address == qec::COUNTERS || address == qec::TARGETS || address == qec::DIRECTIONS)) {
+            for (int i = 0; i < 4; i++) {
+                put_be32(&rx[i * 4], read(address + i + 1));
+            }
+        } else if (len >= 4) {
+            put_be32(rx, read(address));
+        }
+        return;
+    }
+
+    if (len == 1) {
+        pending_address = tx[0];
+        return;
+    }
+
+    if (len % OP_SIZE == 0) {
+        for (int i = 0; i < len; i += OP_SIZE) {
+            op(&tx[i], &rx[i]);
+        }
+        return;
+    }
+
+    if (len > FRAME_HEADER + FRAME_TRAILER && (len - FRAME_HEADER - FRAME_TRAILER) % OP_SIZE == 0) {
+        const int ops_len = len - FRAME_HEADER - FRAME_TRAILER;
+        if (crc8(tx, FRAME_HEADER + ops_len) != tx[FRAME_HEADER + ops_len]) {
+            rx[len - 2] = static_cast<uint8_t>(~tx[0]); // Not echoing the sequence rejects the frame
+            rejected++;
+            return;
+        }
+        for (int i = 0; i < ops_len; i += OP_SIZE) {
+            op(&tx[FRAME_HEADER + i], &rx[FRAME_HEADER + i]);
+        }
+        uint8_t *response = &rx[FRAME_HEADER];
+        response[ops_len + 1] = tx[0];
+        response[ops_len + 2] = crc8(response, ops_len + 2);
+        return;
+    }
+
+    rejected++;
+}
+
+/**
+ * @brief   address byte followed by 4 data bytes, reads are answered in place
+ */
+void pico_emulator::op(const uint8_t *tx, uint8_t *rx) {
+    uint8_t address = tx[0];
+    if ((address & qec::WRITE_MASK) && (address & ~qec::WRITE_MASK) != qec::LIMITS) {
+        write(address, be32(&tx[1]));
+    } else {
+        put_be32(&rx[1], read(address));
+    }
+}
+
+int32_t pico_emulator::read(uint8_t address) {
+    uint8_t reg = address & ~qec::WRITE_MASK;
+    int axis;
+
+    if (reg == qec::LIMITS) {
+        int32_t value = static_cast<int32_t>(static_cast<uint32_t>(hard_limits) << 24 |
+                                             static_cast<uint32_t>(targets_reached) << 16);
+        if (address & qec::WRITE_MASK) {
+            irq_level = false; // ACK
+        }
+        return value;
+    }
+    if ((axis = axis_of(reg, qec::COUNTERS)) >= 0) {
+        return counters[axis];
+    }
+    if ((axis = axis_of(reg, qec::TARGETS)) >= 0) {
+        return targets[axis];
+    }
+    if ((axis = axis_of(reg, qec::DIRECTIONS)) >= 0) {
+        return directions[axis];
+    }
+    if (reg == qec::POS_THRESHOLDS) {
+        return threshold;
+    }
+    if (reg == qec::PWM_SERVO) {
+        return pwm_servo;
+    }
+    return 0;
+}
+
+void pico_emulator::write(uint8_t address, int32_t value) {
+    uint8_t reg = address & ~qec::WRITE_MASK;
+    int axis;
+
+    if ((axis = axis_of(reg, qec::COUNTERS)) >= 0) {
+        counters[axis] = value;
+        update_targets();
+    } else if ((axis = axis_of(reg, qec::TARGETS)) >= 0) {
+        targets[axis] = value;
+        targets_armed[axis] = true;
+        targets_reached &= ~(1 << axis);
+        update_targets();
+    } else if ((axis = axis_of(reg, qec::DIRECTIONS)) >= 0) {
+        directions[axis] = value;
+    } else if (reg == qec::POS_THRESHOLDS) {
+        threshold = value;
+        update_targets();
+    } else if (reg == qec::PWM_SERVO) {
+        pwm_servo = value;
+    }
+}
+
+/**
+ * @brief   the plant moved an encoder
+ * @param   axis    : 0 for X ... 3 for W
+ * @param   counts  : signed displacement
+ */
+void pico_emulator::move(int axis, int32_t counts) {
+    if (axis < 0 || axis >= PICO_EMULATOR_AXES) {
+        return;
+    }
+    counters[axis] += counts;
+    update_targets();
+}
+
+/**
+ * @brief   hard limit inputs, bits 0-1 for X, 2-3 for Y and 4-5 for Z
+ */
+void pico_emulator::set_hard_limits(uint8_t hard) {
+    if (hard != hard_limits) {
+        hard_limits = hard;
+        irq_level = true;
+    }
+}
+
+/**
+ * @brief   raises the IRQ line when an armed target gets inside the threshold
+ */
+void pico_emulator::update_targets() {
+    for (int axis = 0; axis < PICO_EMULATOR_AXES; axis++) {
+        if (targets_armed[axis] && std::abs(counters[axis] - targets[axis]) < threshold) {
+            targets_armed[axis] = false;
+            targets_reached |= (1 << axis);
+            irq_level = true;
+        }
+    }
+}
@@ -1,7 +1,13 @@
 #include "rema.h"
+
+#include <initializer_list>
+
 #include "board.h"
 #include "gpio.h"
 #include "encoders_pico.h"
+#include "events.h"
+#include "scope.h"
+#include "supervisor_timebase.h"
 
 gpio_templ<2, 1, SCU_MODE_FUNC4, 5, 1> brakes_out;               // DOUT0 P2_1    PIN81   GPIO5[1] Bornes 4 y 5
 gpio_templ<4, 6, SCU_MODE_FUNC0, 2, 6> touch_probe_lifter_pwr_out; // DOUT1 P4_6    PIN11   GPIO2[6] Bornes 6 y 7
@@ -18,6 +24,11 @@ int rema::touch_probe_retract_angle = 0;
 int rema::touch_probe_extend_angle = 0;
 
 rema::brakes_mode_t rema::brakes_mode = rema::brakes_mode_t::AUTO;
+volatile rema::brakes_state_t rema::brakes_state = rema::brakes_state_t::APPLIED;
+int rema::brakes_idle_hold_ms = rema::BRAKES_IDLE_HOLD_MS;
+volatile uint32_t rema::brakes_deadline_ms = 0;
+volatile bool rema::brakes_hold_pending = false;
+volatile uint32_t rema::brakes_request_id = 0;
 TickType_t rema::lastKeepAliveTicks;
 
 void rema::init_input_outputs() {
@@ -50,16 +61,91 @@ bool rema::control_enabled_get() {
     return control_enabled;
 }
 
-void rema::brakes_release() {
+/**
+ * @brief   starts releasing the brakes and returns right away. Poll
+ *          brakes_released() to know when the release time has elapsed.
+ * @param   request_id  : posted to events once released, 0 for none
+ * @returns nothing
+ * @note    also cancels a pending idle hold apply, if the brakes are still
+ *          released no time has to be waited.
+ */
+void rema::brakes_release(uint32_t request_id) {
     if (brakes_mode == brakes_mode_t::AUTO || brakes_mode == brakes_mode_t::OFF) {
-        brakes_out.set(true);
-        vTaskDelay(pdMS_TO_TICKS(BRAKES_RELEASE_DELAY_MS));
+        uint32_t superseded = 0;
+        UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+        brakes_hold_pending = false;
+        if (brakes_state == brakes_state_t::APPLIED) {
+            brakes_out.set(true);
+            brakes_deadline_ms = supervisor_timebase::millis() + BRAKES_RELEASE_DELAY_MS;
+            brakes_state = brakes_state_t::RELEASING;
+        }
+        if (request_id) {
+            superseded = brakes_request_id;
+            brakes_request_id = (brakes_state == brakes_state_t::RELEASED) ? 0 : request_id;
+        }
+        taskEXIT_CRITICAL_FROM_ISR(saved);
+
+        events::post(superseded, "brakes", "SUPERSEDED");
+        if (request_id && brakes_released()) {
+            events::post(request_id, "brakes");
+        }
+    } else {
+        events::post(request_id, "brakes", "BRAKES_ON");
     }
 }
 
+bool rema::brakes_released() {
+    return brakes_state == brakes_state_t::RELEASED;
+}
+
 void rema::brakes_apply() {
     if (brakes_mode == brakes_mode_t::AUTO || brakes_mode == brakes_mode_t::ON) {
+        UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+        brakes_hold_pending = false;
         brakes_out.set(false);
+        brakes_state = brakes_state_t::APPLIED;
+        uint32_t interrupted = brakes_request_id;
+        brakes_request_id = 0;
+        taskEXIT_CRITICAL_FROM_ISR(saved);
+
+        events::post(interrupted, "brakes", "BRAKES_APPLIED");
+    }
+}
+
+/**
+ * @brief   applies the brakes once the axes have been idle for
+ *          brakes_idle_hold_ms, so back to back moves don't cycle them.
+ * @returns nothing
+ * @note    callable from ISRs.
+ */
+void rema::brakes_apply_after_hold() {
+    if (brakes_mode != brakes_mode_t::AUTO || brakes_idle_hold_ms <= 0) {
+        brakes_apply();
+        return;
+    }
+
+    UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+    brakes_deadline_ms = supervisor_timebase::millis() + brakes_idle_hold_ms;
+    brakes_hold_pending = true;
+    taskEXIT_CRITICAL_FROM_ISR(saved);
+}
+
+/**
+ * @brief   advances the brakes state machine, called from the supervisor
+ *          timebase ISR.
+ * @returns nothing
+ */
+void rema::brakes_update() {
+    bool elapsed = static_cast<int32_t>(supervisor_timebase::millis() - brakes_deadline_ms) >= 0;
+
+    if (brakes_state == brakes_state_t::RELEASING && elapsed) {
+        brakes_state = brakes_state_t::RELEASED;
+        events::post(brakes_request_id, "brakes");
+        brakes_request_id = 0;
+    }
+
+    if (brakes_hold_pending && elapsed) {
+        brakes_apply();
     }
 }
 
@@ -89,11 +175,25 @@ bool rema::is_watchdog_expired() {
     return ((xTaskGetTickCount() - lastKeepAliveTicks) > pdMS_TO_TICKS(WATCHDOG_TIME_MS));
 }
 
-void rema::hard_limits_reached() {
-    /* TODO Read input pins to determine which limit has been reached and stop
-     * only one motor*/
-    z_dummy_axes->stop();
-    x_y_axes->stop();
+/**
+ * @brief   stops only the axes groups with an axis on a hard limit
+ * @param   hard    : hard limits bits as reported by the encoders
+ * @returns nothing
+ */
+void rema::hard_limits_reached(uint8_t hard) {
+    for (bresenham *axes : { x_y_axes, z_dummy_axes }) {
+        uint8_t mask = 0;
+        for (mot_pap *axis : { axes->first_axis, axes->second_axis }) {
+            if (!axis->is_dummy) {
+                mask |= hard_limits_mask(axis->name);
+            }
+        }
+
+        if (hard & mask) {
+            axes->stop("HARD_LIMIT");
+            lDebug(Warn, "%s: hard limit reached", axes->name);
+        }
+    }
 }
 
 // IRQ Handler for Touch Probe
@@ -117,10 +217,12 @@ extern "C" void GPIO1_IRQHandler(void) {
         if (debounce_time_exceeded) {
             if (x_y_axes->is_moving) {
                 x_y_axes->was_stopped_by_probe = true;
+                scope::trigger(x_y_axes, scope::PROBE);
             }
 
             if (z_dummy_axes->is_moving) {
                 z_dummy_axes->was_stopped_by_probe = true;
+                scope::trigger(z_dummy_axes, scope::PROBE);
             }
 
             x_y_axes->stop();
@@ -0,0 +1,175 @@
+#include "scope.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include "FreeRTOS.h"
+#include "board.h"
+#include "task.h"
+
+#include "bresenham.h"
+#include "debug.h"
+
+volatile scope::state_t scope::state = scope::state_t::IDLE;
+const bresenham *scope::source = nullptr;
+uint8_t scope::channels = scope::FREQ | scope::ERROR_TERM | scope::LEADER_DELTA | scope::P_TERM;
+uint8_t scope::triggers = scope::MOVE_START | scope::STALL | scope::PROBE;
+int scope::decimation = 1;
+int scope::post_trigger = 512;
+volatile uint8_t scope::fired_by = 0;
+
+uint32_t __attribute__((section(".bss.$RamLoc40"))) scope::buffer[SCOPE_BUFFER_WORDS];
+volatile int scope::write_index = 0;
+volatile bool scope::wrapped = false;
+volatile int scope::remaining = 0;
+volatile int scope::trigger_slot = 0;
+int scope::stride = SCOPE_HEADER_WORDS;
+int scope::capacity = SCOPE_BUFFER_WORDS;
+int scope::decimation_counters[2] = { 0, 0 };
+
+/**
+ * @brief   starts recording into the ring. Channels and source must not be
+ *          changed while the scope is armed.
+ * @returns nothing
+ */
+void scope::arm() {
+    state = state_t::IDLE;
+    stride = SCOPE_HEADER_WORDS + __builtin_popcount(channels);
+    capacity = (SCOPE_BUFFER_WORDS / stride) * stride;
+    if (decimation < 1) {
+        decimation = 1;
+    }
+    int max_post_trigger = (capacity / stride) - 1;
+    if (post_trigger > max_post_trigger) {
+        post_trigger = max_post_trigger;
+    }
+    write_index = 0;
+    wrapped = false;
+    fired_by = 0;
+    trigger_slot = 0;
+    decimation_counters[SUPERVISOR] = 0;
+    decimation_counters[ISR] = 0;
+    state = state_t::ARMED;
+    lDebug(Info, "Scope armed, %i words per sample", stride);
+}
+
+void scope::disarm() {
+    state = state_t::IDLE;
+}
+
+/**
+ * @brief   frees the ring after its contents have been dumped
+ * @returns nothing
+ */
+void scope::release() {
+    if (state == state_t::DONE) {
+        state = state_t::IDLE;
+    }
+}
+
+/**
+ * @brief   starts the post trigger countdown if the scope is waiting for this
+ *          trigger source on these axes. Callable from ISRs.
+ * @param   axes    : axes group where the event happened
+ * @param   src     : event that fired the trigger
+ * @returns nothing
+ */
+void scope::trigger(const bresenham *axes, enum trigger_source src) {
+    if (state != state_t::ARMED || axes != source || !(triggers & src)) {
+        return;
+    }
+
+    fired_by = src;
+    trigger_slot = write_index / stride;
+    remaining = post_trigger;
+    state = (post_trigger > 0) ? state_t::TRIGGERED : state_t::DONE;
+}
+
+int scope::words_per_sample() {
+    return stride;
+}
+
+int scope::samples_count() {
+    return wrapped ? (capacity / stride) : (write_index / stride);
+}
+
+/**
+ * @brief   position of the trigger relative to the oldest sample in the ring
+ */
+int scope::trigger_index() {
+    int count = samples_count();
+    if (count == 0) {
+        return 0;
+    }
+    int first = wrapped ? (write_index / stride) : 0;
+    return (trigger_slot - first + count) % count;
+}
+
+/**
+ * @brief   returns the contiguous parts of the ring in chronological order
+ * @param   part    : 0 for the oldest part, 1 for the newest one
+ * @param   start   : will be set to the first word of the part
+ * @returns number of words in the part
+ */
+int scope::region(int part, const uint32_t **start) {
+    if (part == 0) {
+        *start = wrapped ? &buffer[write_index] : &buffer[0];
+        return wrapped ? (capacity - write_index) : write_index;
+    }
+
+    *start = &buffer[0];
+    return wrapped ? write_index : 0;
+}
+
+void scope::capture(const bresenham *axes, enum origin o) {
+    if (++decimation_counters[o] < decimation) {
+        return;
+    }
+    decimation_counters[o] = 0;
+
+    if (o == ISR) {
+        write(axes, o);
+    } else {
+        // The step timer ISR also writes to the ring
+        taskENTER_CRITICAL();
+        write(axes, o);
+        taskEXIT_CRITICAL();
+    }
+}
+
+void scope::write(const bresenham *axes, enum origin o) {
+    uint32_t *p = &buffer[write_index];
+
+    *p++ = DWT->CYCCNT;
+    *p++ = o;
+    if (channels & FREQ) {
+        *p++ = axes->current_freq;
+    }
+    if (channels & ERROR_TERM) {
+        *p++ = axes->error;
+    }
+    if (channels & LEADER_DELTA) {
+        *p++ = axes->leader_axis ? axes->leader_axis->delta : 0;
+    }
+    if (channels & P_TERM) {
+        float p_term = axes->kp.p_term;
+        memcpy(p++, &p_term, sizeof(uint32_t));
+    }
+    if (channels & FIRST_COUNTS) {
+        *p++ = axes->first_axis->current_counts;
+    }
+    if (channels & SECOND_COUNTS) {
+        *p++ = axes->second_axis->current_counts;
+    }
+
+    int next = write_index + stride;
+    if (next >= capacity) {
+        next = 0;
+        wrapped = true;
+    }
+    write_index = next;
+
+    if (state == state_t::TRIGGERED && --remaining <= 0) {
+        state = state_t::DONE;
+    }
+}
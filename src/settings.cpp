@@ -5,6 +5,9 @@
 /* Page used for storage */
 #define PAGE_ADDR 0x01 /* Page number */
 
+/* Pages used for axes compensation tables, one per axis starting at X */
+#define COMPENSATION_PAGE_ADDR 0x02
+
 /**
  * @brief 	default hardcoded settings
  * @returns	copy of settings structure
@@ -68,3 +71,33 @@ void settings::read() {
         lDebug(Info, "Using settings loaded from EEPROM");
     }
 }
+
+/**
+ * @brief 	saves the compensation table of one axis to its own EEPROM page
+ * @param 	axis 	        : 'X', 'Y' or 'Z'
+ * @param 	compensation 	: table to save
+ * @returns	nothing
+ */
+void settings::save_compensation(char axis, axis_compensation &compensation) {
+    uint32_t page = COMPENSATION_PAGE_ADDR + (axis - 'X');
+    EEPROM_Erase(page);
+
+    lDebug(Info, "EEPROM write %c compensation...", axis);
+    EEPROM_Write(0, page, &compensation, sizeof compensation);
+}
+
+/**
+ * @brief 	reads the compensation table of one axis. Erased pages read as
+ * 			all zeros, that is no compensation.
+ * @param 	axis 	        : 'X', 'Y' or 'Z'
+ * @param 	compensation 	: table to fill
+ * @returns	nothing
+ */
+void settings::read_compensation(char axis, axis_compensation &compensation) {
+    EEPROM_Read(0, COMPENSATION_PAGE_ADDR + (axis - 'X'), &compensation, sizeof compensation);
+
+    if (compensation.lut_size < 0 || compensation.lut_size > PITCH_LUT_MAX_SIZE || compensation.lut_spacing < 0) {
+        lDebug(Warn, "Invalid %c compensation loaded from EEPROM. Disabling it", axis);
+        compensation = {};
+    }
+}
@@ -0,0 +1,99 @@
+#include "supervisor_timebase.h"
+
+#include <chrono>
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "board.h"
+#include "task.h"
+
+#include "bresenham.h"
+#include "debug.h"
+#include "rema.h"
+#include "tmr.h"
+
+tmr *supervisor_timebase::tmr = nullptr;
+bresenham *supervisor_timebase::axes[SUPERVISOR_MAX_AXES];
+int supervisor_timebase::axes_count = 0;
+volatile uint32_t supervisor_timebase::ms = 0;
+
+static inline bool is_due(uint32_t now, std::chrono::milliseconds period) {
+    return period.count() <= 1 || (now % period.count()) == 0;
+}
+
+/**
+ * @brief   starts the supervisors timebase on TIMER2
+ * @returns nothing
+ */
+void supervisor_timebase::init() {
+    static class tmr supervisor_tmr(LPC_TIMER2, RGU_TIMER2_RST, CLK_MX_TIMER2, TIMER2_IRQn);
+    tmr = &supervisor_tmr;
+    tmr->set_freq(SUPERVISOR_TIMEBASE_HZ / 2); // tmr doubles the frequency to generate both half pulses
+    tmr->start();
+    lDebug(Info, "Supervisor timebase started at %i Hz", SUPERVISOR_TIMEBASE_HZ);
+}
+
+/**
+ * @brief   registers an axes group whose supervisor has to be notified
+ * @param   axes    : axes group
+ * @returns nothing
+ */
+void supervisor_timebase::add(bresenham *axes) {
+    if (axes_count < SUPERVISOR_MAX_AXES) {
+        supervisor_timebase::axes[axes_count++] = axes;
+    }
+}
+
+/**
+ * @brief   called every timebase period, advances the brakes state machine,
+ *          starts moves that were waiting for the brakes to release and
+ *          notifies the supervisors of moving axes groups with the checks that
+ *          are due.
+ * @returns nothing
+ */
+void supervisor_timebase::isr() {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    uint32_t now = ++ms;
+
+    rema::brakes_update();
+
+    for (int i = 0; i < axes_count; i++) {
+        bresenham *a = axes[i];
+        if (!a->is_moving || a->supervisor_task_handle == nullptr) {
+            continue;
+        }
+
+        if (a->start_pending && rema::brakes_released()) {
+            a->start_step_timer();
+        }
+
+        uint32_t due = 0;
+        if (is_due(now, a->probe_check_period)) {
+            due |= bresenham::PROBE_CHECK;
+        }
+        if (is_due(now, a->stall_check_period)) {
+            due |= bresenham::STALL_CHECK;
+        }
+        if (is_due(now, a->step_time)) {
+            due |= bresenham::CONTROL_UPDATE;
+        }
+        if (is_due(now, a->watchdog_check_period)) {
+            due |= bresenham::WATCHDOG_CHECK;
+        }
+
+        if (due) {
+            xTaskNotifyFromISR(a->supervisor_task_handle, due, eSetBits, &xHigherPriorityTaskWoken);
+        }
+    }
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+/**
+ * @brief   handle interrupt from 32-bit timer used as supervisors timebase
+ * @returns nothing
+ */
+extern "C" void TIMER2_IRQHandler(void) {
+    if (supervisor_timebase::tmr->match_pending()) {
+        supervisor_timebase::isr();
+    }
+}
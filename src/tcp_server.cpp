@@ -18,15 +18,20 @@
 #define KEEPALIVE_INTERVAL (5)
 #define KEEPALIVE_COUNT    (3)
 
-static void stop_all() {
+void tcp_server::stop_all() {
     x_y_axes->stop();
     z_dummy_axes->stop();
     lDebug(Warn, "Stopping all");
 }
 
-
 tcp_server::tcp_server(const char *name, int port) : name(name), port(port) {
+}
 
+/**
+ * @brief 	creates the server task, called once the derived object is
+ * complete so task() dispatches to the right override.
+ */
+void tcp_server::start() {
     char task_name[configMAX_TASK_NAME_LEN];
     memset(task_name, 0, sizeof(task_name));
     strncat(task_name, name, sizeof(task_name) - strlen(task_name) - 1);
@@ -36,44 +41,80 @@ tcp_server::tcp_server(const char *name, int port) : name(name), port(port) {
     lDebug_uart_semihost(Info, "%s: created", task_name);
 }
 
-void tcp_server::task() {
-    char addr_str[128];
-    int ip_protocol = 0;
-    int keepAlive = 1;
-    int keepIdle = KEEPALIVE_IDLE;
-    int keepInterval = KEEPALIVE_INTERVAL;
-    int keepCount = KEEPALIVE_COUNT;
+/**
+ * @brief 	creates, binds and listens on the server socket
+ * @param 	backlog	: connections waiting to be accepted
+ * @returns	the listening socket, or -1 on error
+ */
+int tcp_server::listen_socket(int backlog) {
     struct sockaddr_in dest_addr;
+    dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(port);
 
-    struct sockaddr_in *dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
-    dest_addr_ip4->sin_addr.s_addr = htonl(INADDR_ANY);
-    dest_addr_ip4->sin_family = AF_INET;
-    dest_addr_ip4->sin_port = htons(port);
-    ip_protocol = IPPROTO_IP;
-
-    int listen_sock = lwip_socket(AF_INET, SOCK_STREAM, ip_protocol);
+    int listen_sock = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
     if (listen_sock < 0) {
         lDebug_uart_semihost(Error, "Unable to create %s socket: errno %d", name, errno);
-        vTaskDelete(NULL);
-        return;
+        return -1;
     }
     int opt = 1;
     lwip_setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     lDebug_uart_semihost(Info, "%s socket created", name);
 
-    int err = lwip_bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    if (err != 0) {
+    if (lwip_bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
         lDebug_uart_semihost(Error, "%s socket unable to bind: errno %d", name, errno);
         lDebug_uart_semihost(Error, "IPPROTO: %d", AF_INET);
-        goto CLEAN_UP;
+        lwip_close(listen_sock);
+        return -1;
     }
     lDebug_uart_semihost(Info, "%s socket bound, port %d", name, port);
 
-    err = lwip_listen(listen_sock, 1);
-    if (err != 0) {
+    if (lwip_listen(listen_sock, backlog) != 0) {
         lDebug_uart_semihost(Error, "Error occurred during %s listen: errno %d", name, errno);
-        goto CLEAN_UP;
+        lwip_close(listen_sock);
+        return -1;
+    }
+    return listen_sock;
+}
+
+void tcp_server::set_keepalive(int sock) {
+    int keepAlive = 1;
+    int keepIdle = KEEPALIVE_IDLE;
+    int keepInterval = KEEPALIVE_INTERVAL;
+    int keepCount = KEEPALIVE_COUNT;
+    lwip_setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
+    lwip_setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+    lwip_setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+    lwip_setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+}
+
+/**
+ * @brief 	sends the whole buffer, send() can return less bytes than supplied
+ * @returns	false if the connection failed
+ */
+bool tcp_server::send_all(int sock, const void *buf, int len) {
+    int to_write = len;
+    while (to_write > 0) {
+        int written = lwip_send(sock, static_cast<const uint8_t *>(buf) + (len - to_write), to_write, 0);
+        if (written < 0) {
+            lDebug(Error, "Error occurred during sending: errno %d", errno);
+            return false;
+        }
+        to_write -= written;
+    }
+    return true;
+}
+
+/**
+ * @brief 	serves one client at a time. Only the command server, which
+ * overrides it, stops the axes when the client in control leaves.
+ */
+void tcp_server::task() {
+    int listen_sock = listen_socket(1);
+    if (listen_sock < 0) {
+        vTaskDelete(NULL);
+        return;
     }
 
     while (1) {
@@ -87,25 +128,14 @@ void tcp_server::task() {
             break;
         }
 
-        // Set tcp keepalive option
-        lwip_setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-        lwip_setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
-        lwip_setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
-        lwip_setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
-        // Convert ip address to string
-        if (source_addr.sa_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
-        }
-        //lDebug_uart_semihost(Info, "%s socket accepted ip address: %s", name, addr_str);
+        set_keepalive(sock);
 
-        reply_fn(sock);
-        stop_all();
+        reply_fn(sock); // Telemetry, logs and scope clients leaving don't stop the axes
 
         lwip_shutdown(sock, 0);
         lwip_close(sock);
     }
 
-CLEAN_UP:
     lwip_close(listen_sock);
     vTaskDelete(NULL);
 }
@@ -1,25 +1,33 @@
 //#include <stdlib.h>
 #include "FreeRTOS.h"
 #include "debug.h"
+#include <algorithm>
 #include <cctype>
 #include <memory>
 #include <stdio.h>
 #include <string.h>
 
+#include "autotune.h"
 #include "bresenham.h"
 #include "debug.h"
 #include "encoders_pico.h"
+#include "events.h"
 #include "expected.hpp"
 #include "mot_pap.h"
+#include "perfect_hash.h"
 #include "rema.h"
+#include "scope.h"
 #include "settings.h"
 #include "tcp_server_command.h"
 #include "temperature_ds18b20.h"
 #include "xy_axes.h"
 #include "z_axis.h"
 #include "ip_fns.h"
+#include "telemetry.h"
+#include "udp_telemetry.h"
 
-#define PROTOCOL_VERSION "JSON_1.0"
+#define PROTOCOL_VERSION         "JSON_1.0"
+#define MSGPACK_PROTOCOL_VERSION "MSGPACK_1.0"
 
 namespace json = ArduinoJson;
 
@@ -32,6 +40,19 @@ bresenham *tcp_server_command::get_axes(const char *axis) {
     }
 }
 
+mot_pap *tcp_server_command::get_axis(const char *axis) {
+
+    switch (*axis) {
+    case 'x':
+    case 'X': return x_y_axes->first_axis; break;
+    case 'y':
+    case 'Y': return x_y_axes->second_axis; break;
+    case 'z':
+    case 'Z': return z_dummy_axes->first_axis; break;
+    default: return nullptr; break;
+    }
+}
+
 tl::expected<void, const char *> check_control_and_brakes(bresenham *axes) {
     if (!rema::control_enabled_get()) {
         return tl::make_unexpected("Control is disabled");
@@ -44,9 +65,7 @@ tl::expected<void, const char *> check_control_and_brakes(bresenham *axes) {
     return {}; // Indicating no errors
 }
 
-json::MyJsonDocument tcp_server_command::log_level_cmd(json::JsonObject pars) {
-    json::MyJsonDocument res;
-
+void tcp_server_command::log_level_cmd(json::JsonObject const pars, json::JsonVariant res) {
     if (pars.containsKey("local_level")) {
         char const *level = pars["local_level"];
 
@@ -89,13 +108,11 @@ json::MyJsonDocument tcp_server_command::log_level_cmd(json::JsonObject pars) {
 
     res["local_level"] = levelText(debugLocalLevel);
     res["net_level"] = levelText(debugNetLevel);
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::logs_cmd(json::JsonObject const pars) {
+void tcp_server_command::logs_cmd(json::JsonObject const pars, json::JsonVariant res) {
     double quantity = pars["quantity"];
 
-    json::MyJsonDocument res;
     auto msg_array = res["DEBUG_MSGS"].to<json::JsonArray>();
     int msgs_waiting = uxQueueMessagesWaiting(network_debug_queue);
     int extract = MIN(quantity, msgs_waiting);
@@ -108,19 +125,34 @@ json::MyJsonDocument tcp_server_command::logs_cmd(json::JsonObject const pars) {
             dbg_msg = NULL;
         }
     }
-
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::protocol_version_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
-    res["version"] = PROTOCOL_VERSION;
-    return res;
-}
+void tcp_server_command::protocol_version_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    enum protocol protocol = (current >= 0) ? clients[current].protocol : JSON;
 
-json::MyJsonDocument tcp_server_command::control_enable_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
+    if (pars.containsKey("use")) {
+        char const *use = pars["use"];
+        if (use && !strcmp(use, PROTOCOL_VERSION)) {
+            requested_protocol = JSON;
+        } else if (use && !strcmp(use, MSGPACK_PROTOCOL_VERSION) && current >= 0) {
+            requested_protocol = MSGPACK;
+        } else {
+            res["error"] = "Unsupported protocol";
+        }
+    }
+
+    res["version"] = protocol == MSGPACK ? MSGPACK_PROTOCOL_VERSION : PROTOCOL_VERSION;
+    auto supported = res["supported"].to<json::JsonArray>();
+    supported.add(PROTOCOL_VERSION);
+    supported.add(MSGPACK_PROTOCOL_VERSION);
+
+    // Ids of the MSGPACK protocol are the positions in these lists
+    if (pars["list"] | false) {
+        list_ids(res["commands"].to<json::JsonArray>(), res["keys"].to<json::JsonArray>());
+    }
+}
 
+void tcp_server_command::control_enable_cmd(json::JsonObject const pars, json::JsonVariant res) {
     if (pars.containsKey("enabled")) {
         bool enabled = pars["enabled"];
         rema::control_enabled_set(enabled);
@@ -130,29 +162,33 @@ json::MyJsonDocument tcp_server_command::control_enable_cmd(json::JsonObject con
         }
     }
     res["status"] = rema::control_enabled_get();
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::brakes_mode_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
+void tcp_server_command::brakes_mode_cmd(json::JsonObject const pars, json::JsonVariant res) {
     if (pars.containsKey("mode")) {
         char const *mode = pars["mode"];
 
         if (!strcmp(mode, "OFF")) {
             rema::brakes_mode = rema::brakes_mode_t::OFF;
-            rema::brakes_release();
+            rema::brakes_release(request_id); // Done once the release time has elapsed
         }
 
         if (!strcmp(mode, "AUTO")) {
             rema::brakes_mode = rema::brakes_mode_t::AUTO;
+            events::post(request_id, "brakes");
         }
 
         if (!strcmp(mode, "ON")) {
             rema::brakes_mode = rema::brakes_mode_t::ON;
             rema::brakes_apply();
+            events::post(request_id, "brakes");
         }
     }
 
+    if (pars.containsKey("idle_hold")) {
+        rema::brakes_idle_hold_ms = pars["idle_hold"];
+    }
+
     switch (rema::brakes_mode) {
     case rema::brakes_mode_t::OFF: res["status"] = "OFF"; break;
 
@@ -162,34 +198,31 @@ json::MyJsonDocument tcp_server_command::brakes_mode_cmd(json::JsonObject const
 
     default: break;
     }
-
-    return res;
+    res["idle_hold"] = rema::brakes_idle_hold_ms;
 }
 
-json::MyJsonDocument tcp_server_command::touch_probe_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
+void tcp_server_command::touch_probe_cmd(json::JsonObject const pars, json::JsonVariant res) {
     if (pars.containsKey("position")) {
         if (!rema::control_enabled_get()) {
             res["error"] = "Control is disabled";
-            return res;
+            return;
         }
 
         char const *position = pars["position"];
 
         if (!strcmp(position, "RETRACT")) {
             rema::touch_probe_retract();
+            events::post(request_id, "touch_probe");
         }
 
         if (!strcmp(position, "EXTEND")) {
             rema::touch_probe_extend();
+            events::post(request_id, "touch_probe");
         }
     }
-
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::stall_control_settings_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
+void tcp_server_command::stall_control_settings_cmd(json::JsonObject const pars, json::JsonVariant res) {
     if (pars.containsKey("enabled")) {
         rema::stall_control = pars["enabled"];
     }
@@ -210,11 +243,9 @@ json::MyJsonDocument tcp_server_command::stall_control_settings_cmd(json::JsonOb
     res["counts_X"] = x_y_axes->first_axis->stall_max_count;
     res["counts_Y"] = x_y_axes->second_axis->stall_max_count;
     res["counts_Z"] = z_dummy_axes->first_axis->stall_max_count;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::touch_probe_settings_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
+void tcp_server_command::touch_probe_settings_cmd(json::JsonObject const pars, json::JsonVariant res) {
     if (pars.containsKey("protection")) {
         rema::touch_probe_protection = pars["protection"];
     }
@@ -245,10 +276,9 @@ json::MyJsonDocument tcp_server_command::touch_probe_settings_cmd(json::JsonObje
     res["debounce_time_ms"] = rema::touch_probe_debounce_time_ms;
     res["retract_angle"] = rema::touch_probe_retract_angle;
     res["extend_angle"] = rema::touch_probe_extend_angle;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::set_coords_cmd(json::JsonObject const pars) {
+void tcp_server_command::set_coords_cmd(json::JsonObject const pars, json::JsonVariant res) {
     if (pars.containsKey("position_X")) {
         double pos_x = pars["position_X"];
         x_y_axes->first_axis->set_position(pos_x);
@@ -263,13 +293,10 @@ json::MyJsonDocument tcp_server_command::set_coords_cmd(json::JsonObject const p
         double pos_z = pars["position_Z"];
         z_dummy_axes->first_axis->set_position(pos_z);
     }
-    json::MyJsonDocument res;
     res["ack"] = true;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::axes_settings_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
+void tcp_server_command::axes_settings_cmd(json::JsonObject const pars, json::JsonVariant res) {
     double prop_gain = pars["prop_gain"];
     int update = pars["update"];
     int normal_min = pars["normal_min"];
@@ -284,6 +311,15 @@ json::MyJsonDocument tcp_server_command::axes_settings_cmd(json::JsonObject cons
         axes_->kp.set_output_limits(normal_min, normal_max, slow_min, slow_max);
         axes_->kp.set_sample_period(axes_->step_time);
         axes_->kp.set_tunings(prop_gain);
+        if (pars.containsKey("probe_period")) {
+            axes_->probe_check_period = std::chrono::milliseconds(pars["probe_period"].as<int>());
+        }
+        if (pars.containsKey("stall_period")) {
+            axes_->stall_check_period = std::chrono::milliseconds(pars["stall_period"].as<int>());
+        }
+        if (pars.containsKey("watchdog_period")) {
+            axes_->watchdog_check_period = std::chrono::milliseconds(pars["watchdog_period"].as<int>());
+        }
         lDebug_uart_semihost(Debug, "%s settings set", axes_->name);
     } 
         
@@ -293,6 +329,11 @@ json::MyJsonDocument tcp_server_command::axes_settings_cmd(json::JsonObject cons
     res["XY"]["slow_max_freq"] = x_y_axes->kp.slow_out_max;
     res["XY"]["update_time"] = x_y_axes->step_time.count();
     res["XY"]["prop_gain"] = x_y_axes->kp.kp_;
+    res["XY"]["probe_period"] = x_y_axes->probe_check_period.count();
+    res["XY"]["stall_period"] = x_y_axes->stall_check_period.count();
+    res["XY"]["watchdog_period"] = x_y_axes->watchdog_check_period.count();
+    res["XY"]["move_latency_us"] = x_y_axes->move_latency_cycles / (SystemCoreClock / 1000000);
+    res["XY"]["move_latency_max_us"] = x_y_axes->move_latency_max_cycles / (SystemCoreClock / 1000000);
 
     res["Z"]["normal_min_freq"] = z_dummy_axes->kp.normal_out_min;
     res["Z"]["normal_max_freq"] = z_dummy_axes->kp.normal_out_max;
@@ -300,27 +341,27 @@ json::MyJsonDocument tcp_server_command::axes_settings_cmd(json::JsonObject cons
     res["Z"]["slow_max_freq"] = z_dummy_axes->kp.slow_out_max;
     res["Z"]["update_time"] = z_dummy_axes->step_time.count();
     res["Z"]["prop_gain"] = z_dummy_axes->kp.kp_;
-    return res;
+    res["Z"]["probe_period"] = z_dummy_axes->probe_check_period.count();
+    res["Z"]["stall_period"] = z_dummy_axes->stall_check_period.count();
+    res["Z"]["watchdog_period"] = z_dummy_axes->watchdog_check_period.count();
+    res["Z"]["move_latency_us"] = z_dummy_axes->move_latency_cycles / (SystemCoreClock / 1000000);
+    res["Z"]["move_latency_max_us"] = z_dummy_axes->move_latency_max_cycles / (SystemCoreClock / 1000000);
 }
 
-json::MyJsonDocument tcp_server_command::axes_hard_stop_all_cmd(json::JsonObject const pars) {
+void tcp_server_command::axes_hard_stop_all_cmd(json::JsonObject const pars, json::JsonVariant res) {
     x_y_axes->send({ mot_pap::HARD_STOP });
     z_dummy_axes->send({ mot_pap::HARD_STOP });
 
-    json::MyJsonDocument res;
     res["ack"] = true;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::axes_soft_stop_all_cmd(json::JsonObject const pars) {
+void tcp_server_command::axes_soft_stop_all_cmd(json::JsonObject const pars, json::JsonVariant res) {
     x_y_axes->send({ mot_pap::SOFT_STOP });
     z_dummy_axes->send({ mot_pap::SOFT_STOP });
-    json::MyJsonDocument res;
     res["ack"] = true;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::network_settings_cmd(json::JsonObject const pars) {
+void tcp_server_command::network_settings_cmd(json::JsonObject const pars, json::JsonVariant res) {
     char const *ipaddr = pars["ipaddr"];
     char const *netmask = pars["netmask"];
     char const *gw = pars["gw"];
@@ -352,7 +393,6 @@ json::MyJsonDocument tcp_server_command::network_settings_cmd(json::JsonObject c
         Chip_RGU_TriggerReset(RGU_CORE_RST);
     }
 
-    json::MyJsonDocument res;
     char ip_dot_format[15];
     ipaddr_to_dot_format(settings::network.ipaddr, ip_dot_format);
     res["ipaddr"] = ip_dot_format;
@@ -364,36 +404,168 @@ json::MyJsonDocument tcp_server_command::network_settings_cmd(json::JsonObject c
     res["gw"] = ip_dot_format;
 
     res["port"] = settings::network.port;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::mem_info_cmd(json::JsonObject const pars) {
-    auto res = json::MyJsonDocument();
+/**
+ * @brief   configures the UDP telemetry publisher. Destinations replace the
+ *          current ones, given as [["239.0.0.10", 5005], ["192.168.2.20", 5006]].
+ */
+void tcp_server_command::udp_telemetry_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    if (pars.containsKey("destinations")) {
+        udp_telemetry::clear_destinations();
+        for (json::JsonArray destination : pars["destinations"].as<json::JsonArray>()) {
+            char const *address = destination[0];
+            uint16_t port = destination[1] | 0;
+
+            int octet1, octet2, octet3, octet4;
+            if (!address || port == 0 || sscanf(address, "%d.%d.%d.%d", &octet1, &octet2, &octet3, &octet4) != 4) {
+                res["error"] = "Invalid destination";
+                continue;
+            }
+
+            ip_addr_t addr;
+            IP4_ADDR(&addr, octet1, octet2, octet3, octet4);
+            if (!udp_telemetry::add_destination(addr, port)) {
+                res["error"] = "Too many destinations";
+            }
+        }
+    }
+
+    if (pars.containsKey("period")) {
+        telemetry::configs[telemetry::UDP].period_ms =
+            std::clamp(static_cast<int>(pars["period"]), TELEMETRY_MIN_PERIOD_MS, TELEMETRY_MAX_PERIOD_MS);
+    }
+
+    if (pars.containsKey("enabled")) {
+        udp_telemetry::enabled = pars["enabled"];
+    }
+
+    res["enabled"] = udp_telemetry::enabled;
+    res["period"] = telemetry::configs[telemetry::UDP].period_ms;
+    res["seq"] = udp_telemetry::seq;
+    res["errors"] = udp_telemetry::errors;
+    res["oversize"] = udp_telemetry::oversize;
+
+    udp_telemetry_destination destinations[UDP_TELEMETRY_MAX_DESTINATIONS];
+    int count = udp_telemetry::get_destinations(destinations);
+    json::JsonArray list = res["destinations"].to<json::JsonArray>();
+    for (int i = 0; i < count; i++) {
+        char ip_dot_format[16];
+        ipaddr_to_dot_format(destinations[i].addr, ip_dot_format);
+        json::JsonArray destination = list.add<json::JsonArray>();
+        destination.add(ip_dot_format);
+        destination.add(destinations[i].port);
+    }
+}
+
+/**
+ * @brief   subscribes a telemetry stream, "TCP" unless "stream" says "UDP",
+ *          to field groups and axes: {"fields": ["coords"], "axes": "XY",
+ *          "period": 10}. Fields replace the current ones, "all" selects
+ *          every group. "delta": N switches to delta frames with a keyframe
+ *          every N frames, 0 back to nested documents. "list" answers the
+ *          names of the delta field ids. The TCP period is capped at
+ *          TELEMETRY_TCP_MAX_PERIOD_MS, its frames feed the watchdog.
+ */
+void tcp_server_command::telemetry_config_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    char const *stream = pars["stream"] | telemetry::stream_names[telemetry::TCP];
+    int index = telemetry::STREAMS_COUNT;
+    for (int i = 0; i < telemetry::STREAMS_COUNT; i++) {
+        if (!strcmp(stream, telemetry::stream_names[i])) {
+            index = i;
+        }
+    }
+    if (index == telemetry::STREAMS_COUNT) {
+        res["error"] = "Unknown stream";
+        return;
+    }
+    telemetry_config &config = telemetry::configs[index];
+
+    if (pars.containsKey("fields")) {
+        uint32_t groups = 0;
+        for (char const *field : pars["fields"].as<json::JsonArray>()) {
+            if (field && !strcmp(field, "all")) {
+                groups = telemetry::ALL;
+                continue;
+            }
+            bool found = false;
+            for (int g = 0; g < telemetry::GROUPS_COUNT; g++) {
+                if (field && !strcmp(field, telemetry::group_names[g])) {
+                    groups |= 1 << g;
+                    found = true;
+                }
+            }
+            if (!found) { // Nothing changes, a typo mustn't unsubscribe the other groups
+                res["error"] = "Unknown field group";
+                return;
+            }
+        }
+        config.groups = groups;
+    }
+
+    if (pars.containsKey("axes")) {
+        uint8_t axes = 0;
+        char const *selected = pars["axes"];
+        for (char const *axis = selected; axis && *axis; axis++) {
+            int i = toupper(*axis) - 'X';
+            if (i >= 0 && i < TELEMETRY_AXES) {
+                axes |= 1 << i;
+            }
+        }
+        config.axes = axes;
+    }
+
+    if (pars.containsKey("period")) {
+        int max_period = index == telemetry::TCP ? TELEMETRY_TCP_MAX_PERIOD_MS : TELEMETRY_MAX_PERIOD_MS;
+        config.period_ms = std::clamp(static_cast<int>(pars["period"]), TELEMETRY_MIN_PERIOD_MS, max_period);
+    }
+
+    if (pars.containsKey("delta")) {
+        config.keyframe_every = std::max(static_cast<int>(pars["delta"]), 0);
+    }
+
+    if (pars["list"] | false) {
+        telemetry::list_fields(res["field_ids"].to<json::JsonArray>());
+    }
+
+    res["stream"] = telemetry::stream_names[index];
+    json::JsonArray fields = res["fields"].to<json::JsonArray>();
+    for (int g = 0; g < telemetry::GROUPS_COUNT; g++) {
+        if (config.groups & (1 << g)) {
+            fields.add(telemetry::group_names[g]);
+        }
+    }
+    char axes[TELEMETRY_AXES + 1] = {};
+    for (int i = 0, n = 0; i < TELEMETRY_AXES; i++) {
+        if (config.axes & (1 << i)) {
+            axes[n++] = static_cast<char>('X' + i);
+        }
+    }
+    res["axes"] = axes;
+    res["period"] = config.period_ms;
+    res["delta"] = config.keyframe_every;
+}
+
+void tcp_server_command::mem_info_cmd(json::JsonObject const pars, json::JsonVariant res) {
     res["total"] = configTOTAL_HEAP_SIZE;
     res["free"] = xPortGetFreeHeapSize();
     res["min_free"] = xPortGetMinimumEverFreeHeapSize();
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::temperature_info_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
+void tcp_server_command::temperature_info_cmd(json::JsonObject const pars, json::JsonVariant res) {
     res["temp_X"] = static_cast<double>(temperature_ds18b20_get(0)) / 10;
     res["temp_Y"] = static_cast<double>(temperature_ds18b20_get(1)) / 10;
     res["temp_Z"] = static_cast<double>(temperature_ds18b20_get(2)) / 10;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::move_closed_loop_cmd(json::JsonObject const pars) {
+void tcp_server_command::move_closed_loop_cmd(json::JsonObject const pars, json::JsonVariant res) {
     char const *axes = pars["axes"];
     bresenham *axes_ = get_axes(axes);
 
-
-    json::MyJsonDocument res;
-
     auto check_result = check_control_and_brakes(axes_);
     if (!check_result) {
         res["error"] = check_result.error();
-        return res;
+        return;
     }
 
     double first_axis_setpoint = pars["first_axis_setpoint"];
@@ -409,6 +581,7 @@ json::MyJsonDocument tcp_server_command::move_closed_loop_cmd(json::JsonObject c
     }
 
     msg.type = mot_pap::type::MOVE;
+    msg.request_id = request_id;
     msg.first_axis_setpoint = static_cast<int>(first_axis_setpoint * axes_->first_axis->inches_to_counts_factor);
     msg.second_axis_setpoint = static_cast<int>(second_axis_setpoint * axes_->second_axis->inches_to_counts_factor);
 
@@ -422,18 +595,16 @@ json::MyJsonDocument tcp_server_command::move_closed_loop_cmd(json::JsonObject c
     //     second_axis_setpoint);
 
     res["ack"] = true;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::move_joystick_cmd(json::JsonObject const pars) {
+void tcp_server_command::move_joystick_cmd(json::JsonObject const pars, json::JsonVariant res) {
     char const *axes = pars["axes"];
     bresenham *axes_ = get_axes(axes);
-    json::MyJsonDocument res;
 
     auto check_result = check_control_and_brakes(axes_);
     if (!check_result) {
         res["error"] = check_result.error();
-        return res;
+        return;
     }
 
     int first_axis_setpoint, second_axis_setpoint;
@@ -451,6 +622,7 @@ json::MyJsonDocument tcp_server_command::move_joystick_cmd(json::JsonObject cons
 
     bresenham_msg msg;
     msg.type = mot_pap::type::MOVE;
+    msg.request_id = request_id;
     msg.first_axis_setpoint = first_axis_setpoint;
     msg.second_axis_setpoint = second_axis_setpoint;
     axes_->send(msg);
@@ -459,18 +631,16 @@ json::MyJsonDocument tcp_server_command::move_joystick_cmd(json::JsonObject cons
     //        first_axis_setpoint, second_axis_setpoint);
 
     res["ack"] = true;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::move_incremental_cmd(json::JsonObject const pars) {
+void tcp_server_command::move_incremental_cmd(json::JsonObject const pars, json::JsonVariant res) {
     char const *axes = pars["axes"];
     bresenham *axes_ = get_axes(axes);
-    json::MyJsonDocument res;
 
     auto check_result = check_control_and_brakes(axes_);
     if (!check_result) {
         res["error"] = check_result.error();
-        return res;
+        return;
     }
 
     double first_axis_delta, second_axis_delta;
@@ -488,6 +658,7 @@ json::MyJsonDocument tcp_server_command::move_incremental_cmd(json::JsonObject c
 
     bresenham_msg msg;
     msg.type = mot_pap::type::MOVE;
+    msg.request_id = request_id;
     msg.first_axis_setpoint =
         axes_->first_axis->current_counts + (first_axis_delta * axes_->first_axis->inches_to_counts_factor);
     msg.second_axis_setpoint =
@@ -497,143 +668,646 @@ json::MyJsonDocument tcp_server_command::move_incremental_cmd(json::JsonObject c
     // Setpoint= %i",
     //        msg.first_axis_setpoint, msg.second_axis_setpoint);
     res["ack"] = true;
-    return res;
 }
 
-json::MyJsonDocument tcp_server_command::read_encoders_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
-
+void tcp_server_command::read_encoders_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    struct encoders_snapshot snapshot = encoders->snapshot();
     if (pars.containsKey("axis")) {
         char const *axis = pars["axis"];
-        res[axis] = encoders->read_counter(axis[0]);
-        return res;
+        if (axis == nullptr || axis[0] < 'X' || axis[0] > 'Z') {
+            res["error"] = "Invalid axis";
+            return;
+        }
+        res[axis] = snapshot.counters[axis[0] - 'X'];
     } else {
+        res["X"] = snapshot.counters[0];
+        res["Y"] = snapshot.counters[1];
+        res["Z"] = snapshot.counters[2];
+        res["age_ms"] = (xTaskGetTickCount() - snapshot.ticks) * portTICK_PERIOD_MS;
+    }
+}
+
+void tcp_server_command::encoders_settings_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    if (pars.containsKey("sampling_period")) {
+        encoders->sampling_period_ms = pars["sampling_period"];
+    }
+
+    if (pars.containsKey("framed")) {
+        encoders->framed = pars["framed"];
+    }
+
+    if (pars.containsKey("batched")) {
+        encoders->batched = pars["batched"];
+    }
+
+    if (pars["reset_stats"] | false) {
+        encoders->reset_link_stats();
+    }
+
+    if (pars["calibrate"] | false) {
+        if (x_y_axes->is_moving || z_dummy_axes->is_moving) {
+            res["error"] = "Axes are moving";
+            return;
+        }
+        if (!encoders->calibrate_bus()) {
+            res["error"] = "Calibration needs framed transactions";
+            return;
+        }
+    }
+
+    res["sampling_period"] = encoders->sampling_period_ms;
+    res["framed"] = encoders->framed;
+    res["batched"] = encoders->batched;
+    res["bitrate"] = spi_bitrate;
+    res["max_good_bitrate"] = encoders->max_good_bitrate;
+    res["guard_us"] = spi_guard_us;
+    res["frames"] = encoders->link_stats.frames;
+    res["crc_errors"] = encoders->link_stats.crc_errors;
+    res["seq_errors"] = encoders->link_stats.seq_errors;
+    res["retries"] = encoders->link_stats.retries;
+    res["failures"] = encoders->link_stats.failures;
+    res["sample_failures"] = encoders->sample_failures;
+}
+
+void tcp_server_command::spi_stats_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    const uint32_t cycles_per_us = SystemCoreClock / 1000000;
 
-        uint8_t rx[4 * 3] = { 0x00 };
-        encoders->read_counters(rx);
-        int32_t x = (rx[0] << 24 | rx[1] << 16 | rx[2] << 8 | rx[3] << 0);
-        int32_t y = (rx[4] << 24 | rx[5] << 16 | rx[6] << 8 | rx[7] << 0);
-        int32_t z = (rx[8] << 24 | rx[9] << 16 | rx[10] << 8 | rx[11] << 0);
-        int32_t w [[maybe_unused]] = (rx[12] << 24 | rx[13] << 16 | rx[14] << 8 | rx[15] << 0);
+    auto histogram = [cycles_per_us](json::JsonObject obj, const latency_histogram &h) {
+        obj["count"] = h.count;
+        obj["max_us"] = h.max_cycles / cycles_per_us;
+        json::JsonArray buckets = obj["buckets"].to<json::JsonArray>();
+        for (uint32_t bucket : h.buckets) {
+            buckets.add(bucket);
+        }
+    };
+
+    for (int i = 0; i < spi_stats::CALL_SITES_COUNT; i++) {
+        json::JsonObject site = res[spi_stats::names[i]].to<json::JsonObject>();
+        histogram(site["wait"].to<json::JsonObject>(), spi_stats::wait[i]);
+        histogram(site["transfer"].to<json::JsonObject>(), spi_stats::transfer[i]);
+    }
 
-        res["X"] = x;
-        res["Y"] = y;
-        res["Z"] = z;
-        return res;
+    for (int i = 0; i < encoders_pico::PRIORITIES_COUNT; i++) {
+        json::JsonObject bus = res["bus"][encoders_pico::priority_names[i]].to<json::JsonObject>();
+        bus["requests"] = encoders->bus_stats[i].requests;
+        bus["lane_timeouts"] = encoders->bus_stats[i].lane_timeouts;
+        bus["preempted"] = encoders->bus_stats[i].preempted;
+        bus["rejected"] = encoders->bus_stats[i].rejected;
+    }
+
+    if (pars["reset"] | false) {
+        spi_stats::reset();
+        for (struct encoders_bus_stats &stats : encoders->bus_stats) {
+            stats = {};
+        }
     }
 }
 
-json::MyJsonDocument tcp_server_command::read_limits_cmd(json::JsonObject const pars) {
-    json::MyJsonDocument res;
-    res["ack"] = encoders->read_limits().hard;
-    return res;
+void tcp_server_command::control_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    if (pars["take"] | false) {
+        take_control();
+    }
+    if ((pars["release"] | false) && owner == current) {
+        owner = -1;
+        lDebug(Info, "Motion control released");
+    }
+
+    int connected = 0;
+    for (const client &c : clients) {
+        connected += c.sock >= 0;
+    }
+    res["owner"] = owner == current;
+    res["held"] = owner >= 0;
+    res["clients"] = connected;
+}
+
+void tcp_server_command::read_limits_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    res["ack"] = encoders->snapshot().limits.hard;
+}
+
+void tcp_server_command::scope_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    static const struct {
+        const char *name;
+        uint8_t mask;
+    } channel_names[] = {
+        { "FREQ", scope::FREQ },
+        { "ERROR", scope::ERROR_TERM },
+        { "LEADER_DELTA", scope::LEADER_DELTA },
+        { "P_TERM", scope::P_TERM },
+        { "FIRST_COUNTS", scope::FIRST_COUNTS },
+        { "SECOND_COUNTS", scope::SECOND_COUNTS },
+    }, trigger_names[] = {
+        { "MOVE_START", scope::MOVE_START },
+        { "STALL", scope::STALL },
+        { "PROBE", scope::PROBE },
+    };
+
+    bool reconfigure = pars.containsKey("axes") || pars.containsKey("channels") || pars.containsKey("triggers") ||
+                       pars.containsKey("decimation") || pars.containsKey("post_trigger");
+    if (reconfigure) {
+        scope::disarm();
+    }
+
+    if (pars.containsKey("axes")) {
+        char const *axes = pars["axes"];
+        if (axes) {
+            scope::source = get_axes(axes);
+        } else {
+            res["error"] = "Unknown axes";
+        }
+    }
+
+    if (pars.containsKey("channels")) {
+        scope::channels = 0;
+        for (char const *channel : pars["channels"].as<json::JsonArray>()) {
+            for (auto const &entry : channel_names) {
+                if (!strcmp(channel, entry.name)) {
+                    scope::channels |= entry.mask;
+                }
+            }
+        }
+    }
+
+    if (pars.containsKey("triggers")) {
+        scope::triggers = 0;
+        for (char const *trigger : pars["triggers"].as<json::JsonArray>()) {
+            for (auto const &entry : trigger_names) {
+                if (!strcmp(trigger, entry.name)) {
+                    scope::triggers |= entry.mask;
+                }
+            }
+        }
+    }
+
+    if (pars.containsKey("decimation")) {
+        scope::decimation = pars["decimation"];
+    }
+
+    if (pars.containsKey("post_trigger")) {
+        scope::post_trigger = pars["post_trigger"];
+    }
+
+    if (pars.containsKey("arm")) {
+        if (pars["arm"]) {
+            if (scope::source == nullptr) {
+                res["error"] = "No axes selected";
+                return;
+            }
+            scope::arm();
+        } else {
+            scope::disarm();
+        }
+    }
+
+    switch (scope::state) {
+    case scope::state_t::IDLE: res["state"] = "IDLE"; break;
+
+    case scope::state_t::ARMED: res["state"] = "ARMED"; break;
+
+    case scope::state_t::TRIGGERED: res["state"] = "TRIGGERED"; break;
+
+    case scope::state_t::DONE: res["state"] = "DONE"; break;
+
+    default: break;
+    }
+
+    res["axes"] = scope::source ? scope::source->name : "";
+    auto channels = res["channels"].to<json::JsonArray>();
+    for (auto const &entry : channel_names) {
+        if (scope::channels & entry.mask) {
+            channels.add(entry.name);
+        }
+    }
+    auto triggers = res["triggers"].to<json::JsonArray>();
+    for (auto const &entry : trigger_names) {
+        if (scope::triggers & entry.mask) {
+            triggers.add(entry.name);
+        }
+    }
+    res["decimation"] = scope::decimation;
+    res["post_trigger"] = scope::post_trigger;
+    res["samples"] = scope::samples_count();
+}
+
+void tcp_server_command::autotune_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    if (pars.containsKey("distance")) {
+        char const *axes = pars["axes"];
+        if (axes == nullptr) {
+            res["error"] = "Missing axes";
+            return;
+        }
+        bresenham *axes_ = get_axes(axes);
+
+        auto check_result = check_control_and_brakes(axes_);
+        if (!check_result) {
+            res["error"] = check_result.error();
+            return;
+        }
+
+        float gains[autotune::MAX_TRIALS];
+        int gains_count = 0;
+        for (float gain : pars["gains"].as<json::JsonArray>()) {
+            if (gains_count < autotune::MAX_TRIALS) {
+                gains[gains_count++] = gain;
+            }
+        }
+        if (gains_count == 0) {
+            gains[gains_count++] = axes_->kp.kp_;
+        }
+
+        int max_freqs[autotune::MAX_TRIALS];
+        int max_freqs_count = 0;
+        for (int max_freq : pars["max_freqs"].as<json::JsonArray>()) {
+            if (max_freqs_count < autotune::MAX_TRIALS) {
+                max_freqs[max_freqs_count++] = max_freq;
+            }
+        }
+
+        double distance = pars["distance"];
+        int max_overshoot = pars["max_overshoot"] | 0;
+        bool apply = pars["apply"] | false;
+        int distance_counts = static_cast<int>(distance * axes_->first_axis->inches_to_counts_factor);
+
+        if (!autotune::start(
+                axes_, distance_counts, gains, gains_count, max_freqs, max_freqs_count, max_overshoot, apply)) {
+            res["error"] = "Autotune already running or invalid parameters";
+            return;
+        }
+    }
+
+    res["running"] = autotune::running;
+    if (autotune::axes) {
+        res["axes"] = autotune::axes->name;
+    }
+
+    auto trials = res["trials"].to<json::JsonArray>();
+    for (int i = 0; i < autotune::trials_count; i++) {
+        const autotune_trial &trial = autotune::trials[i];
+        auto t = trials.add<json::JsonObject>();
+        t["prop_gain"] = trial.gain;
+        t["max_freq"] = trial.max_freq;
+        t["rise_ms"] = trial.rise_ms;
+        t["settling_ms"] = trial.settling_ms;
+        t["overshoot"] = trial.overshoot;
+        t["stalled"] = trial.stalled;
+        t["settled"] = trial.settled;
+    }
+
+    if (!autotune::running && autotune::best >= 0) {
+        res["best"] = autotune::best;
+        res["proposed"]["prop_gain"] = autotune::trials[autotune::best].gain;
+        res["proposed"]["normal_min_freq"] = autotune::proposed_normal_min;
+        res["proposed"]["normal_max_freq"] = autotune::proposed_normal_max;
+        res["proposed"]["slow_min_freq"] = autotune::proposed_slow_min;
+        res["proposed"]["slow_max_freq"] = autotune::proposed_slow_max;
+        res["applied"] = autotune::applied;
+    }
+}
+
+void tcp_server_command::compensation_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    char const *axis_name = pars["axis"];
+    mot_pap *axis = axis_name ? get_axis(axis_name) : nullptr;
+    if (!axis) {
+        res["error"] = "Unknown axis";
+        return;
+    }
+
+    if (get_axes(axis_name)->is_moving) {
+        res["error"] = "Axis is moving";
+        return;
+    }
+
+    const double factor = axis->inches_to_counts_factor;
+    axis_compensation &compensation = axis->compensation;
+    axis_compensation updated = compensation; // Nothing applied unless every value fits
+
+    if (pars.containsKey("backlash")) {
+        double backlash = pars["backlash"];
+        updated.backlash = static_cast<int32_t>(backlash * factor);
+    }
+
+    if (pars.containsKey("lut")) {
+        double lut_origin = pars["lut_origin"];
+        double lut_spacing = pars["lut_spacing"];
+        updated.lut_origin = static_cast<int32_t>(lut_origin * factor);
+        updated.lut_spacing = static_cast<int32_t>(lut_spacing * factor);
+        updated.lut_size = 0;
+        for (double error : pars["lut"].as<json::JsonArray>()) {
+            double counts = error * factor;
+            if (counts < INT16_MIN || counts > INT16_MAX) {
+                res["error"] = "Pitch error out of range";
+                return;
+            }
+            if (updated.lut_size < PITCH_LUT_MAX_SIZE) {
+                updated.lut[updated.lut_size++] = static_cast<int16_t>(counts);
+            }
+        }
+    }
+
+    if (pars.containsKey("backlash") || pars.containsKey("lut")) {
+        compensation = updated;
+        axis->backlash_offset = 0; // The old backlash isn't taken up anymore, as in set_position()
+        axis->last_dir = mot_pap::direction::NONE;
+    }
+
+    if (pars["save"] | false) {
+        settings::save_compensation(axis->name, compensation);
+    }
+
+    res["backlash"] = compensation.backlash / factor;
+    res["lut_origin"] = compensation.lut_origin / factor;
+    res["lut_spacing"] = compensation.lut_spacing / factor;
+    auto lut = res["lut"].to<json::JsonArray>();
+    for (int i = 0; i < compensation.lut_size; i++) {
+        lut.add(compensation.lut[i] / factor);
+    }
 }
 
 // @formatter:off
-const tcp_server_command::cmd_entry tcp_server_command::cmds_table[] = {
+const char *const tcp_server_command::param_keys[] = {
+    "apply", "arm", "axes", "axis", "backlash", "calibrate", "channels", "counts_X", "counts_XY", "counts_Y",
+    "counts_Z", "debounce_time_ms", "decimation", "distance", "enabled", "extend_angle", "first_axis_delta",
+    "first_axis_setpoint", "framed", "gains", "gw", "idle_hold", "ipaddr", "list", "local_level", "lut", "lut_origin",
+    "lut_spacing", "max_freqs", "max_overshoot", "mode", "net_level", "netmask", "normal_max", "normal_min", "port",
+    "position", "position_X", "position_Y", "position_Z", "post_trigger", "probe_period", "prop_gain", "protection",
+    "quantity", "release", "reset", "reset_stats", "retract_angle", "sampling_period", "save", "second_axis_delta",
+    "second_axis_setpoint", "slow_max", "slow_min", "speed", "stall_period", "take", "triggers", "update", "use",
+    "watchdog_period",
+    "destinations",
+    "period",
+    "fields",
+    "stream",
+    "delta",
+    "batched",
+};
+
+// Command ids of the MSGPACK protocol are the positions in this table, append new commands at the end
+constexpr tcp_server_command::cmd_entry tcp_server_command::cmds_table[] = {
     {
         "PROTOCOL_VERSION",                        /* Command name */
         &tcp_server_command::protocol_version_cmd, /* Associated function */
+        false,                                     /* Requires motion control */
     },
     {
         "CONTROL_ENABLE",
         &tcp_server_command::control_enable_cmd,
+        true,
     },
     {
         "BRAKES_MODE",
         &tcp_server_command::brakes_mode_cmd,
+        true,
     },
     {
         "TOUCH_PROBE",
         &tcp_server_command::touch_probe_cmd,
+        true,
     },
     {
         "STALL_CONTROL_SETTINGS",
         &tcp_server_command::stall_control_settings_cmd,
+        true,
     },
     {
         "TOUCH_PROBE_SETTINGS",
         &tcp_server_command::touch_probe_settings_cmd,
+        true,
     },
     {
         "AXES_HARD_STOP_ALL",
         &tcp_server_command::axes_hard_stop_all_cmd,
+        false,
     },
     {
         "AXES_SOFT_STOP_ALL",
         &tcp_server_command::axes_soft_stop_all_cmd,
+        false,
     },
     {
         "LOGS",
         &tcp_server_command::logs_cmd,
+        false,
     },
     {
         "LOG_LEVEL",
         &tcp_server_command::log_level_cmd,
+        false,
     },
 
     {
         "AXES_SETTINGS",
         &tcp_server_command::axes_settings_cmd,
+        true,
     },
     {
         "NETWORK_SETTINGS",
         &tcp_server_command::network_settings_cmd,
+        true,
     },
     {
         "MEM_INFO",
         &tcp_server_command::mem_info_cmd,
+        false,
     },
     {
         "TEMP_INFO",
         &tcp_server_command::temperature_info_cmd,
+        false,
     },
     {
         "SET_COORDS",
         &tcp_server_command::set_coords_cmd,
+        true,
     },
     {
         "MOVE_JOYSTICK",
         &tcp_server_command::move_joystick_cmd,
+        true,
     },
     {
         "MOVE_CLOSED_LOOP",
         &tcp_server_command::move_closed_loop_cmd,
+        true,
     },
     {
         "MOVE_INCREMENTAL",
         &tcp_server_command::move_incremental_cmd,
+        true,
     },
     {
         "READ_ENCODERS",
         &tcp_server_command::read_encoders_cmd,
+        false,
     },
     {
         "READ_LIMITS",
         &tcp_server_command::read_limits_cmd,
+        false,
+    },
+    {
+        "SCOPE",
+        &tcp_server_command::scope_cmd,
+        true,
+    },
+    {
+        "AUTOTUNE",
+        &tcp_server_command::autotune_cmd,
+        true,
+    },
+    {
+        "COMPENSATION",
+        &tcp_server_command::compensation_cmd,
+        true,
+    },
+    {
+        "ENCODERS_SETTINGS",
+        &tcp_server_command::encoders_settings_cmd,
+        true,
+    },
+    {
+        "SPI_STATS",
+        &tcp_server_command::spi_stats_cmd,
+        false,
+    },
+    {
+        "CONTROL",
+        &tcp_server_command::control_cmd,
+        false,
+    },
+    {
+        "CMD_STATS",
+        &tcp_server_command::cmd_stats_cmd,
+        false,
+    },
+    {
+        "UDP_TELEMETRY",
+        &tcp_server_command::udp_telemetry_cmd,
+        false,
+    },
+    {
+        "TELEMETRY_CONFIG",
+        &tcp_server_command::telemetry_config_cmd,
+        false,
     },
 };
 // @formatter:on
 
+void tcp_server_command::list_ids(json::JsonArray commands, json::JsonArray keys) {
+    for (const cmd_entry &entry : cmds_table) {
+        commands.add(entry.cmd_name);
+    }
+    for (const char *key : param_keys) {
+        keys.add(key);
+    }
+}
+
+static constexpr int cmds_count = sizeof(tcp_server_command::cmds_table) / sizeof(tcp_server_command::cmds_table[0]);
+static_assert(cmds_count < CMD_HASH_SLOTS, "grow CMD_HASH_SLOTS");
+
+static constexpr auto cmd_slots = perfect_hash<CMD_HASH_SLOTS>::build(
+    [](int i) { return tcp_server_command::cmds_table[i].cmd_name; }, cmds_count, CMD_HASH_MAX_SEED);
+static_assert(cmd_slots.seed != 0, "no perfect hash seed for cmds_table, grow CMD_HASH_SLOTS");
+
+/**
+ * @struct  cmd_stats
+ * @brief   dispatch cost, in DWT->CYCCNT cycles.
+ */
+struct cmd_stats {
+    uint32_t count;
+    uint64_t total_cycles;
+    uint32_t max_cycles;
+
+    void record(uint32_t cycles) {
+        count++;
+        total_cycles += cycles;
+        if (cycles > max_cycles) {
+            max_cycles = cycles;
+        }
+    }
+};
+
+static cmd_stats lookup_stats;              // name to entry
+static cmd_stats handler_stats[cmds_count]; // per command
+
+/**
+ * @brief 	finds a command by name, one hash and one string compare
+ * @returns	position in cmds_table[], or -1 if there is no such command
+ */
+int tcp_server_command::cmd_lookup(char const *cmd) {
+    if (cmd == nullptr) {
+        return -1;
+    }
+    int index = cmd_slots.find(cmd);
+    return (index >= 0 && !strcmp(cmd, cmds_table[index].cmd_name)) ? index : -1;
+}
+
+/**
+ * @brief 	runs the command at index in cmds_table[] if the client is allowed to
+ */
+void tcp_server_command::cmd_run(int index, json::JsonObject const pars, json::JsonVariant res) {
+    const cmd_entry &entry = cmds_table[index];
+    if (entry.requires_control && !take_control()) {
+        lDebug(Warn, "%s rejected, motion control is held by another client", entry.cmd_name);
+        res.set("NOT IN CONTROL");
+        return;
+    }
+
+    uint32_t start = DWT->CYCCNT;
+    (this->*(entry.cmd_function))(pars, res);
+    handler_stats[index].record(DWT->CYCCNT - start);
+}
+
 /**
  * @brief 	searchs for a matching command name in cmds_table[], passing the
  * parameters as a JSON object for the called function to parse them.
  * @param 	*cmd 	:name of the command to execute
  * @param   *pars   :JSON object containing the passed parameters to the called
  * function
+ * @param 	res	:slot of the response where the command writes its answer
  */
-json::MyJsonDocument tcp_server_command::cmd_execute(char const *cmd, json::JsonObject const pars) {
-    for (unsigned int i = 0; i < (sizeof(cmds_table) / sizeof(cmds_table[0])); i++) {
-        if (!strcmp(cmd, cmds_table[i].cmd_name)) {
-            // return cmds_table[i].cmd_function(pars);
-            return (this->*(cmds_table[i].cmd_function))(pars);
+void tcp_server_command::cmd_execute(char const *cmd, json::JsonObject const pars, json::JsonVariant res) {
+    uint32_t start = DWT->CYCCNT;
+    int index = cmd_lookup(cmd);
+    lookup_stats.record(DWT->CYCCNT - start);
+
+    if (index < 0) {
+        lDebug_uart_semihost(Error, "No matching command found");
+        res.set("UNKNOWN COMMAND");
+        return;
+    }
+    cmd_run(index, pars, res);
+}
+
+void tcp_server_command::cmd_stats_cmd(json::JsonObject const pars, json::JsonVariant res) {
+    const uint32_t cycles_per_us = SystemCoreClock / 1000000;
+
+    res["lookup"]["count"] = lookup_stats.count;
+    res["lookup"]["avg_cycles"] = lookup_stats.count ? static_cast<uint32_t>(lookup_stats.total_cycles / lookup_stats.count) : 0;
+    res["lookup"]["max_cycles"] = lookup_stats.max_cycles;
+
+    res["arena"]["size"] = TCP_SERVER_COMMAND_ARENA_SIZE;
+    res["arena"]["high_water"] = arena.high_water;
+    res["arena"]["overflows"] = arena.overflows;
+
+    for (int i = 0; i < cmds_count; i++) {
+        const cmd_stats &stats = handler_stats[i];
+        if (stats.count) {
+            json::JsonObject cmd = res["commands"][cmds_table[i].cmd_name].to<json::JsonObject>();
+            cmd["count"] = stats.count;
+            cmd["avg_us"] = static_cast<uint32_t>(stats.total_cycles / stats.count / cycles_per_us);
+            cmd["max_us"] = stats.max_cycles / cycles_per_us;
         }
     }
-    lDebug_uart_semihost(Error, "No matching command found");
-    json::MyJsonDocument res;
-    res.set("UNKNOWN COMMAND");
-    return res;
-};
+
+    if (pars["reset"] | false) {
+        lookup_stats = {};
+        arena.high_water = 0;
+        arena.overflows = 0;
+        for (cmd_stats &stats : handler_stats) {
+            stats = {};
+        }
+    }
+}
 
 /**
  * @brief Defines a simple wire protocol base on JavaScript Object Notation
@@ -671,44 +1345,399 @@ json::MyJsonDocument tcp_server_command::cmd_execute(char const *cmd, json::Json
 
 /**
  * @brief 	Parses the received JSON object looking for commands to execute
- * and appends the outputs of the called commands to the response buffer.
+ * and sends back the outputs of the called commands.
  * @param 	*rx_buff 	:pointer to the received buffer from the network
- * @param   **tx_buff	:pointer to pointer, will be set to the allocated return
- * buffer
- * @returns	the length of the allocated response buffer
+ * @param 	rx_len		:received bytes
+ * @param   &c			:client the answer goes to
+ * @returns	false if the connection failed
  */
-int tcp_server_command::json_wp(char *rx_buff, char **tx_buff) {
-    auto rx_JSON_value = json::MyJsonDocument();
-    json::DeserializationError error = json::deserializeJson(rx_JSON_value, rx_buff);
+bool tcp_server_command::json_wp(const char *rx_buff, int rx_len, client &c) {
+    auto rx_JSON_value = json::MyJsonDocument(&arena);
+    json::DeserializationError error = json::deserializeJson(rx_JSON_value, rx_buff, rx_len);
 
-    auto tx_JSON_value = json::MyJsonDocument();
-    *tx_buff = NULL;
-    int buff_len = 0;
+    auto tx_JSON_value = json::MyJsonDocument(&arena);
 
     if (error) {
         lDebug_uart_semihost(Error, "Error json parse. %s", error.c_str());
-        x_y_axes->stop();
-        z_dummy_axes->stop();
+        if (owner < 0 || owner == current) { // Garbage from a monitoring client doesn't stop the axes
+            x_y_axes->stop();
+            z_dummy_axes->stop();
+        }
+        return send_parse_error(c, tx_JSON_value);
     } else {
         for (json::JsonVariant command : rx_JSON_value.as<json::JsonArray>()) {
             char const *command_name = command["cmd"];
             lDebug_uart_semihost(Info, "Command Found: %s", command_name);
             auto pars = command["pars"];
 
-            auto ans = cmd_execute(command_name, pars);
-            tx_JSON_value[command_name] = ans;
+            request_id = command["id"] | static_cast<uint32_t>(0);
+            json::JsonVariant answer = tx_JSON_value[command_name].to<json::JsonVariant>();
+            cmd_execute(command_name, pars, answer);
+            echo_request_id(answer);
+        }
+        request_id = 0;
+        return send_answer(c, tx_JSON_value);
+    }
+    return true;
+}
+
+/**
+ * @brief 	MessagePack flavour of json_wp(). Receives an array of commands,
+ * each one an array with the command id (position in cmds_table[]) and an
+ * optional flat array of parameter key ids (position in param_keys[]) and
+ * values:
+ *
+ * [[5, [17, 500, 52, 100]], [1]]
+ *
+ * A third element, if present, is the request id of the command.
+ *
+ * Parameters are translated back to their names, so the same handlers run
+ * for both protocols. Answers are sent as a flat array of command ids and
+ * the objects returned by the commands: [5, {...}, 1, {...}]
+ * @param 	*rx_buff 	:pointer to the received buffer from the network
+ * @param 	rx_len		:received bytes
+ * @param   &c			:client the answer goes to
+ * @returns	false if the connection failed
+ */
+bool tcp_server_command::msgpack_wp(const char *rx_buff, int rx_len, client &c) {
+    const int keys_count = sizeof(param_keys) / sizeof(param_keys[0]);
+
+    auto rx_doc = json::MyJsonDocument(&arena);
+    json::DeserializationError error = json::deserializeMsgPack(rx_doc, rx_buff, rx_len);
+
+    if (error) {
+        lDebug_uart_semihost(Error, "Error msgpack parse. %s", error.c_str());
+        if (owner < 0 || owner == current) { // Garbage from a monitoring client doesn't stop the axes
+            x_y_axes->stop();
+            z_dummy_axes->stop();
+        }
+        auto error_doc = json::MyJsonDocument(&arena);
+        return send_parse_error(c, error_doc);
+    }
+
+    auto tx_doc = json::MyJsonDocument(&arena);
+    json::JsonArray answers = tx_doc.to<json::JsonArray>();
+    for (json::JsonArray command : rx_doc.as<json::JsonArray>()) {
+        int id = command[0] | -1;
+        answers.add(id);
+        if (id < 0 || id >= cmds_count) {
+            lDebug_uart_semihost(Error, "No matching command id %d", id);
+            answers.add("UNKNOWN COMMAND");
+            continue;
+        }
+
+        auto pars_doc = json::MyJsonDocument(&arena);
+        json::JsonObject pars = pars_doc.to<json::JsonObject>();
+        json::JsonArray flat = command[1];
+        for (auto it = flat.begin(); it != flat.end(); ++it) {
+            int key = (*it) | -1;
+            if (++it == flat.end()) {
+                break;
+            }
+            if (key >= 0 && key < keys_count) {
+                pars[json::JsonString(param_keys[key], json::JsonString::Linked)] = *it; // Interned, not copied
+            }
+        }
+
+        request_id = command[2] | static_cast<uint32_t>(0);
+        json::JsonVariant answer = answers.add<json::JsonVariant>();
+        cmd_run(id, pars, answer);
+        echo_request_id(answer);
+    }
+    request_id = 0;
+    return send_answer(c, tx_doc);
+}
+
+/**
+ * @brief 	answers a frame that didn't parse, so framed clients keep one
+ * answer per frame. Legacy clients never got one.
+ * @returns	false if the connection failed
+ */
+bool tcp_server_command::send_parse_error(client &c, json::JsonDocument &doc) {
+    if (c.legacy) {
+        return true;
+    }
+    doc.clear();
+    doc["error"] = "PARSE ERROR";
+    return send_answer(c, doc);
+}
+
+/**
+ * @brief 	adds the request id of the command just run to its answer
+ */
+void tcp_server_command::echo_request_id(json::JsonVariant answer) {
+    if (request_id && (answer.isNull() || answer.is<json::JsonObject>())) {
+        answer["id"] = request_id;
+    }
+}
+
+/**
+ * @brief 	pushes the completions and failures posted since the last call to
+ * the client holding motion control, every action with a request id comes from
+ * a command requiring it. Events are objects with a single "EVENT" key, so
+ * MSGPACK clients tell them apart from the answer arrays.
+ */
+void tcp_server_command::push_events() {
+    struct event e;
+    while (events::receive(e)) {
+        if (owner < 0) {
+            continue; // Nobody to tell, the client will learn it from telemetry
+        }
+
+        int index = owner;
+        current = index;
+        bool sent;
+        { // The document has to be gone before the arena is reset
+            auto doc = json::MyJsonDocument(&arena);
+            json::JsonObject ev = doc["EVENT"].to<json::JsonObject>();
+            ev["id"] = e.id;
+            ev["source"] = json::JsonString(e.source, json::JsonString::Linked);
+            ev["status"] = e.failure ? "FAILED" : "DONE";
+            if (e.failure) {
+                ev["reason"] = json::JsonString(e.failure, json::JsonString::Linked);
+            }
+            ev["millis"] = e.millis;
+            ev["cycles"] = e.cycles;
+            sent = send_answer(clients[index], doc);
+        }
+        arena.reset();
+        if (!sent) {
+            drop_client(index);
         }
+        current = -1;
+    }
+}
+
+/**
+ * @brief 	gives motion control to the current client if nobody holds it
+ * @returns	true if the current client holds motion control
+ */
+bool tcp_server_command::take_control() {
+    if (owner < 0 && current >= 0) {
+        owner = current;
+        lDebug(Info, "Motion control taken by client %d", current);
+    }
+    return owner >= 0 && owner == current;
+}
+
+void tcp_server_command::accept_client(int listen_sock) {
+    struct sockaddr source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+    int sock = lwip_accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if (sock < 0) {
+        lDebug_uart_semihost(Error, "Unable to accept %s connection: errno %d", name, errno);
+        return;
+    }
+
+    for (int i = 0; i < TCP_SERVER_COMMAND_MAX_CLIENTS; i++) {
+        if (clients[i].sock < 0) {
+            set_keepalive(sock);
+            clients[i] = {};
+            clients[i].sock = sock;
+            lDebug(Info, "%s client %d connected", name, i);
+            return;
+        }
+    }
+
+    lDebug(Warn, "%s: too many clients, connection refused", name);
+    lwip_close(sock);
+}
+
+/**
+ * @brief 	closes a client connection, stopping all the axes only if it held
+ * motion control
+ */
+void tcp_server_command::drop_client(int index) {
+    lwip_shutdown(clients[index].sock, 0);
+    lwip_close(clients[index].sock);
+    clients[index].sock = -1;
+    lDebug(Info, "%s client %d disconnected", name, index);
+
+    if (owner == index) {
+        owner = -1;
+        stop_all();
+    }
+}
+
+/**
+ * @brief 	serializes an answer straight into the socket, TCP_MSS bytes at a
+ * time, framed unless the client is a legacy one. The frame length comes from
+ * measuring the document first, so no buffer ever holds the whole answer.
+ * @returns	false if the connection failed
+ */
+bool tcp_server_command::send_answer(client &c, json::JsonDocument &doc) {
+    int len = (c.protocol == MSGPACK) ? json::measureMsgPack(doc) : json::measureJson(doc);
+    if (len > UINT16_MAX && !c.legacy) {
+        lDebug(Error, "%s: answer of %d bytes doesn't fit a frame", name, len);
+        doc.clear();
+        doc["error"] = "ANSWER TOO LARGE";
+        len = (c.protocol == MSGPACK) ? json::measureMsgPack(doc) : json::measureJson(doc);
+    }
 
-        buff_len = json::measureJson(tx_JSON_value); /* returns 0 on fail */
-        buff_len++;
-        *tx_buff = new char[buff_len];
-        if (!(*tx_buff)) {
-            lDebug_uart_semihost(Error, "Out Of Memory");
-            buff_len = 0;
+    socket_writer writer(c.sock, tx_chunk, sizeof(tx_chunk));
+    if (c.legacy) {
+        json::serializeJson(doc, writer);
+        writer.write(static_cast<uint8_t>('\0')); // Legacy clients get the null terminator
+    } else {
+        const uint8_t header[TCP_SERVER_COMMAND_FRAME_HEADER] = { static_cast<uint8_t>((len >> 8) & 0xFF),
+                                                                  static_cast<uint8_t>(len & 0xFF) };
+        writer.write(header, sizeof(header));
+        if (c.protocol == MSGPACK) {
+            json::serializeMsgPack(doc, writer);
         } else {
-            json::serializeJson(tx_JSON_value, *tx_buff, buff_len);
-            lDebug_uart_semihost(Info, "%s", *tx_buff);
+            json::serializeJson(doc, writer);
+        }
+    }
+    return writer.flush();
+}
+
+/**
+ * @brief 	runs the commands of one frame and sends back the answers
+ * @returns	false if the connection failed
+ */
+bool tcp_server_command::run_frame(client &c, const char *payload, int len) {
+    requested_protocol = c.protocol;
+    bool sent = (c.protocol == MSGPACK) ? msgpack_wp(payload, len, c) : json_wp(payload, len, c);
+    arena.reset(); // The request documents are gone, the next one starts from scratch
+
+    // Negotiated by PROTOCOL_VERSION, its own answer still goes in the old protocol
+    c.protocol = requested_protocol;
+    return sent;
+}
+
+/**
+ * @brief 	receives what the client sent and runs every complete frame
+ * @param 	index	: slot of the client in clients[]
+ * @returns	false if the connection was closed or failed
+ */
+bool tcp_server_command::serve(int index) {
+    client &c = clients[index];
+    char *rx = rx_buffers[index];
+    const int capacity = TCP_SERVER_COMMAND_FRAME_HEADER + TCP_SERVER_COMMAND_MAX_FRAME;
+
+    int len = lwip_recv(c.sock, rx + c.rx_len, capacity - c.rx_len, 0);
+    if (len < 0) {
+        lDebug(Error, "Error occurred during receiving command: errno %d", errno);
+        return false;
+    } else if (len == 0) {
+        lDebug(Warn, "Command connection closed");
+        return false;
+    }
+    c.rx_len += len;
+
+    if (!c.detected) {
+        c.detected = true;
+        c.legacy = rx[0] == '[';
+        if (c.legacy) {
+            lDebug(Warn, "%s client %d is not framing its commands", name, index);
+        }
+    }
+
+    if (c.legacy) { // Whatever was received is taken as one document
+        rx[c.rx_len] = 0;
+        lDebug_uart_semihost(Info, "Command received %s", rx);
+        c.rx_len = 0;
+        return run_frame(c, rx, len);
+    }
+
+    int pos = 0;
+    while (true) {
+        if (c.discard) {
+            int skipped = std::min(c.discard, c.rx_len - pos);
+            c.discard -= skipped;
+            pos += skipped;
+            if (c.discard) {
+                break;
+            }
+        }
+
+        if (c.rx_len - pos < TCP_SERVER_COMMAND_FRAME_HEADER) {
+            break;
         }
+        const uint8_t *header = reinterpret_cast<const uint8_t *>(&rx[pos]);
+        int frame_len = header[0] << 8 | header[1];
+
+        if (frame_len > TCP_SERVER_COMMAND_MAX_FRAME) {
+            lDebug(Error, "%s client %d: frame of %d bytes rejected", name, index, frame_len);
+            c.discard = frame_len;
+            pos += TCP_SERVER_COMMAND_FRAME_HEADER;
+
+            bool sent;
+            {
+                auto error_doc = json::MyJsonDocument(&arena);
+                error_doc["error"] = "FRAME TOO LARGE";
+                error_doc["max"] = TCP_SERVER_COMMAND_MAX_FRAME;
+                sent = send_answer(c, error_doc);
+            }
+            arena.reset();
+            if (!sent) {
+                return false;
+            }
+            continue;
+        }
+
+        if (c.rx_len - pos - TCP_SERVER_COMMAND_FRAME_HEADER < frame_len) {
+            break; // Rest of the frame still on its way
+        }
+
+        if (!run_frame(c, &rx[pos + TCP_SERVER_COMMAND_FRAME_HEADER], frame_len)) {
+            return false;
+        }
+        pos += TCP_SERVER_COMMAND_FRAME_HEADER + frame_len;
+    }
+
+    // Keep the partial frame at the start of the buffer
+    memmove(rx, &rx[pos], c.rx_len - pos);
+    c.rx_len -= pos;
+    return true;
+}
+
+/**
+ * @brief 	event loop of the command server, waits on the listening socket
+ * and every connected client at once.
+ */
+void tcp_server_command::task() {
+    int listen_sock = listen_socket(TCP_SERVER_COMMAND_MAX_CLIENTS);
+    if (listen_sock < 0) {
+        vTaskDelete(NULL);
+        return;
+    }
+    lDebug_uart_semihost(Info, "%s socket listening", name);
+
+    while (true) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(listen_sock, &read_set);
+        int max_sock = listen_sock;
+        for (const client &c : clients) {
+            if (c.sock >= 0) {
+                FD_SET(c.sock, &read_set);
+                max_sock = std::max(max_sock, c.sock);
+            }
+        }
+
+        // Woken up to push the events, their timestamps don't depend on it
+        struct timeval timeout = { 0, TCP_SERVER_COMMAND_EVENTS_POLL_MS * 1000 };
+        if (lwip_select(max_sock + 1, &read_set, NULL, NULL, &timeout) < 0) {
+            lDebug(Error, "Error occurred during %s select: errno %d", name, errno);
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        for (int i = 0; i < TCP_SERVER_COMMAND_MAX_CLIENTS; i++) {
+            if (clients[i].sock >= 0 && FD_ISSET(clients[i].sock, &read_set)) {
+                current = i;
+                if (!serve(i)) {
+                    drop_client(i);
+                }
+                current = -1;
+            }
+        }
+
+        if (FD_ISSET(listen_sock, &read_set)) {
+            accept_client(listen_sock);
+        }
+
+        push_events();
     }
-    return buff_len;
 }
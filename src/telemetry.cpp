@@ -0,0 +1,250 @@
+#include "telemetry.h"
+
+#include <cstdint>
+#include <cstdio>
+
+#include "encoders_pico.h"
+#include "mot_pap.h"
+#include "rema.h"
+#include "temperature_ds18b20.h"
+#include "xy_axes.h"
+#include "z_axis.h"
+
+static mot_pap *motor(int axis) {
+    switch (axis) {
+    case 0: return x_y_axes->first_axis;
+    case 1: return x_y_axes->second_axis;
+    default: return z_dummy_axes->first_axis;
+    }
+}
+
+static telemetry::value real(double v) {
+    telemetry::value value{ telemetry::value::REAL, {} };
+    value.real = v;
+    return value;
+}
+
+static telemetry::value integer(int32_t v) {
+    telemetry::value value{ telemetry::value::INTEGER, {} };
+    value.integer = v;
+    return value;
+}
+
+static telemetry::value boolean(bool v) {
+    telemetry::value value{ telemetry::value::BOOLEAN, {} };
+    value.boolean = v;
+    return value;
+}
+
+static telemetry::value coords(const encoders_snapshot &snapshot, int axis) {
+    mot_pap *m = motor(axis);
+    int counts = m->current_counts; // Dummy axes have no encoder
+    if (!m->is_dummy) {
+        counts = m->reversed_encoder ? -snapshot.counters[m->name - 'X'] : snapshot.counters[m->name - 'X'];
+    }
+    return real(counts / static_cast<double>(m->inches_to_counts_factor));
+}
+
+static telemetry::value target(const encoders_snapshot &, int axis) {
+    return real(motor(axis)->destination_counts / static_cast<double>(motor(axis)->inches_to_counts_factor));
+}
+
+static telemetry::value stalled(const encoders_snapshot &, int axis) {
+    return boolean(motor(axis)->stalled);
+}
+
+static telemetry::value hard_limit(const encoders_snapshot &snapshot, int bit) {
+    return boolean(snapshot.limits.hard & 1 << bit);
+}
+
+static telemetry::value temperature(int sensor) {
+    return real((static_cast<double>(temperature_ds18b20_get(sensor))) / 10);
+}
+
+// Append only, delta frames identify the fields by their position
+const telemetry::field telemetry::fields[TELEMETRY_FIELDS] = {
+    { COORDS, 0, "coords", "x", coords },
+    { COORDS, 1, "coords", "y", coords },
+    { COORDS, 2, "coords", "z", coords },
+    { TARGETS, 0, "targets", "x", target },
+    { TARGETS, 1, "targets", "y", target },
+    { TARGETS, 2, "targets", "z", target },
+    { STALLED, 0, "stalled", "x", stalled },
+    { STALLED, 1, "stalled", "y", stalled },
+    { STALLED, 2, "stalled", "z", stalled },
+    // Soft stops are only sent by joystick, so no ON_CONDITION reported
+    { TARGETS, -1, "on_condition", "x_y", [](const encoders_snapshot &, int) {
+         return boolean(x_y_axes->already_there && !x_y_axes->was_soft_stopped);
+     } },
+    { TARGETS, -1, "on_condition", "z", [](const encoders_snapshot &, int) {
+         return boolean(z_dummy_axes->already_there && !z_dummy_axes->was_soft_stopped);
+     } },
+    { LIMITS, -1, "limits", "left", [](const encoders_snapshot &s, int) { return hard_limit(s, 0); } },
+    { LIMITS, -1, "limits", "right", [](const encoders_snapshot &s, int) { return hard_limit(s, 1); } },
+    { LIMITS, -1, "limits", "up", [](const encoders_snapshot &s, int) { return hard_limit(s, 2); } },
+    { LIMITS, -1, "limits", "down", [](const encoders_snapshot &s, int) { return hard_limit(s, 3); } },
+    { LIMITS, -1, "limits", "in", [](const encoders_snapshot &s, int) { return hard_limit(s, 4); } },
+    { LIMITS, -1, "limits", "out", [](const encoders_snapshot &s, int) { return hard_limit(s, 5); } },
+    { LIMITS, -1, "limits", "probe", [](const encoders_snapshot &, int) {
+         return boolean(touch_probe_irq_pin.read());
+     } },
+    { PROBE, -1, "probe", "x_y", [](const encoders_snapshot &, int) {
+         return boolean(x_y_axes->was_stopped_by_probe);
+     } },
+    { PROBE, -1, "probe", "z", [](const encoders_snapshot &, int) {
+         return boolean(z_dummy_axes->was_stopped_by_probe);
+     } },
+    { PROBE, -1, nullptr, "probe_protected", [](const encoders_snapshot &, int) {
+         return boolean(x_y_axes->was_stopped_by_probe_protection || z_dummy_axes->was_stopped_by_probe_protection);
+     } },
+    { DIAGNOSTICS, -1, nullptr, "control_enabled", [](const encoders_snapshot &, int) {
+         return boolean(rema::control_enabled);
+     } },
+    { DIAGNOSTICS, -1, nullptr, "stall_control", [](const encoders_snapshot &, int) {
+         return boolean(rema::stall_control);
+     } },
+    { DIAGNOSTICS, -1, nullptr, "brakes_mode", [](const encoders_snapshot &, int) {
+         return integer(static_cast<int>(rema::brakes_mode));
+     } },
+    { DIAGNOSTICS, -1, "spi", "crc_errors", [](const encoders_snapshot &, int) {
+         return integer(encoders->link_stats.crc_errors);
+     } },
+    { DIAGNOSTICS, -1, "spi", "seq_errors", [](const encoders_snapshot &, int) {
+         return integer(encoders->link_stats.seq_errors);
+     } },
+    { DIAGNOSTICS, -1, "spi", "retries", [](const encoders_snapshot &, int) {
+         return integer(encoders->link_stats.retries);
+     } },
+    { DIAGNOSTICS, -1, "spi", "failures", [](const encoders_snapshot &, int) {
+         return integer(encoders->link_stats.failures);
+     } },
+    { TEMPS, -1, "temps", "x", [](const encoders_snapshot &, int) { return temperature(0); } },
+    { TEMPS, -1, "temps", "y", [](const encoders_snapshot &, int) { return temperature(1); } },
+    { TEMPS, -1, "temps", "z", [](const encoders_snapshot &, int) { return temperature(2); } },
+};
+
+static_assert(TELEMETRY_FIELDS <= 64, "sent is a 64 bits mask");
+
+bool telemetry::value::operator==(const value &other) const {
+    if (kind != other.kind) {
+        return false;
+    }
+    switch (kind) {
+    case REAL: return real == other.real;
+    case INTEGER: return integer == other.integer;
+    case BOOLEAN: return boolean == other.boolean;
+    }
+    return false;
+}
+
+bool telemetry::subscribed(const field &f, uint32_t groups, uint8_t axes) {
+    return (groups & f.group) && (f.axis < 0 || (axes & (1 << f.axis)));
+}
+
+/**
+ * @brief   names of the fields in id order, "parent.key" or just "key"
+ */
+void telemetry::list_fields(json::JsonArray names) {
+    for (const field &f : fields) {
+        char name[32];
+        if (f.parent) {
+            snprintf(name, sizeof(name), "%s.%s", f.parent, f.key);
+        } else {
+            snprintf(name, sizeof(name), "%s", f.key);
+        }
+        names.add(name);
+    }
+}
+
+/**
+ * @brief   fills ans with the subscribed field groups, as a nested document or
+ *          as a delta frame. Only the encoders and the state behind those
+ *          groups are read.
+ * @param   ans : document to fill, reused from call to call
+ */
+void telemetry::build(json::JsonDocument &ans) {
+    const uint32_t groups = config.groups;
+    const uint8_t axes = config.axes;
+    const int keyframe_every = config.keyframe_every;
+    const bool delta = keyframe_every > 0;
+
+    if (groups != built_groups || axes != built_axes || delta != built_delta) {
+        ans.clear(); // Drop the fields no longer subscribed
+        built_groups = groups;
+        built_axes = axes;
+        built_delta = delta;
+        sent = 0; // Start over with a keyframe
+    }
+
+    // One snapshot for the whole frame, so coords and limits are consistent
+    encoders_snapshot snapshot = {};
+    if (groups & (COORDS | LIMITS)) {
+        snapshot = encoders->snapshot();
+    }
+
+    if (delta) {
+        build_delta(ans, snapshot, groups, axes, keyframe_every);
+    } else {
+        build_nested(ans, snapshot, groups, axes);
+    }
+}
+
+void telemetry::build_nested(json::JsonDocument &ans, const encoders_snapshot &snapshot, uint32_t groups,
+                             uint8_t axes) {
+    json::JsonObject t = ans["telemetry"];
+    if (t.isNull()) {
+        t = ans["telemetry"].to<json::JsonObject>();
+    }
+
+    uint32_t readings = temps_readings;
+    bool new_temps = (groups & TEMPS) && readings != temps_seen;
+    temps_seen = readings;
+    if (!new_temps) {
+        ans.remove("temps");
+    }
+
+    for (const field &f : fields) {
+        if (!subscribed(f, groups, axes)) {
+            continue;
+        }
+        json::JsonString key(f.key, json::JsonString::Linked);
+
+        if (f.group == TEMPS) {
+            if (new_temps) { // Right in the document, not in "telemetry"
+                f.read(snapshot, f.axis).store(ans[json::JsonString(f.parent, json::JsonString::Linked)][key]);
+            }
+        } else if (f.parent) {
+            f.read(snapshot, f.axis).store(t[json::JsonString(f.parent, json::JsonString::Linked)][key]);
+        } else {
+            f.read(snapshot, f.axis).store(t[key]);
+        }
+    }
+}
+
+void telemetry::build_delta(json::JsonDocument &ans, const encoders_snapshot &snapshot, uint32_t groups, uint8_t axes,
+                            int keyframe_every) {
+    ans.clear();
+
+    bool keyframe = sent == 0 || ++frames_since_key >= keyframe_every;
+    if (keyframe) {
+        frames_since_key = 0;
+    }
+    ans["key"] = keyframe;
+
+    json::JsonArray d = ans["d"].to<json::JsonArray>();
+    for (int id = 0; id < TELEMETRY_FIELDS; id++) {
+        const field &f = fields[id];
+        if (!subscribed(f, groups, axes)) {
+            continue;
+        }
+
+        value v = f.read(snapshot, f.axis);
+        const uint64_t bit = static_cast<uint64_t>(1) << id;
+        if (keyframe || !(sent & bit) || !(v == last[id])) {
+            d.add(id);
+            v.store(d.add<json::JsonVariant>());
+            last[id] = v;
+            sent |= bit;
+        }
+    }
+}
@@ -75,7 +75,7 @@ static void temperature_ds18b20_task(void *par) {
             sensors[i].reading = sensors[i].ds18b20->readTemperature();
         }
 
-        new_temps_available = true;
+        temps_readings++;
         vTaskDelay(pdMS_TO_TICKS(reading_interval));
     }
 }
@@ -0,0 +1,109 @@
+#include "udp_telemetry.h"
+
+#include <cstdint>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "lwip/sockets.h"
+
+#include "arduinojson_cust_alloc.h"
+#include "debug.h"
+#include "supervisor_timebase.h"
+#include "telemetry.h"
+
+namespace json = ArduinoJson;
+
+volatile bool udp_telemetry::enabled = false;
+volatile uint32_t udp_telemetry::seq = 0;
+volatile uint32_t udp_telemetry::errors = 0;
+volatile uint32_t udp_telemetry::oversize = 0;
+udp_telemetry_destination udp_telemetry::destinations[UDP_TELEMETRY_MAX_DESTINATIONS];
+int udp_telemetry::destinations_count = 0;
+uint8_t udp_telemetry::frame[UDP_TELEMETRY_MAX_FRAME];
+
+void udp_telemetry::start() {
+    xTaskCreate(udp_telemetry::task, "udp_telemetry", 1024, NULL, UDP_TELEMETRY_TASK_PRIORITY, NULL);
+    lDebug_uart_semihost(Info, "udp_telemetry: created");
+}
+
+/**
+ * @brief   adds a unicast or multicast destination
+ * @returns false if there is no room for it
+ */
+bool udp_telemetry::add_destination(ip_addr_t addr, uint16_t port) {
+    bool added = false;
+    taskENTER_CRITICAL();
+    if (destinations_count < UDP_TELEMETRY_MAX_DESTINATIONS) {
+        destinations[destinations_count++] = { addr, port };
+        added = true;
+    }
+    taskEXIT_CRITICAL();
+    return added;
+}
+
+void udp_telemetry::clear_destinations() {
+    taskENTER_CRITICAL();
+    destinations_count = 0;
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief   copies the destinations, so they can change while sending
+ * @param   out : room for UDP_TELEMETRY_MAX_DESTINATIONS
+ * @returns how many were copied
+ */
+int udp_telemetry::get_destinations(udp_telemetry_destination *out) {
+    taskENTER_CRITICAL();
+    int count = destinations_count;
+    for (int i = 0; i < count; i++) {
+        out[i] = destinations[i];
+    }
+    taskEXIT_CRITICAL();
+    return count;
+}
+
+void udp_telemetry::task([[maybe_unused]] void *pars) {
+    int sock = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        lDebug_uart_semihost(Error, "Unable to create udp_telemetry socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    const telemetry_config &config = telemetry::configs[telemetry::UDP];
+    json::MyJsonDocument ans;
+    telemetry builder(config);
+    udp_telemetry_destination targets[UDP_TELEMETRY_MAX_DESTINATIONS];
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (true) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(config.period_ms));
+
+        int count = get_destinations(targets);
+        if (!enabled || count == 0) {
+            continue;
+        }
+
+        builder.build(ans);
+        ans["seq"] = ++seq;
+        ans["millis"] = supervisor_timebase::millis();
+
+        size_t len = json::measureMsgPack(ans);
+        if (len > sizeof(frame)) {
+            oversize++;
+            continue;
+        }
+        json::serializeMsgPack(ans, frame, sizeof(frame));
+
+        for (int i = 0; i < count; i++) {
+            struct sockaddr_in to = {};
+            to.sin_family = AF_INET;
+            to.sin_port = htons(targets[i].port);
+            to.sin_addr.s_addr = targets[i].addr.addr;
+            if (lwip_sendto(sock, frame, len, 0, reinterpret_cast<struct sockaddr *>(&to), sizeof(to)) < 0) {
+                errors++;
+            }
+        }
+    }
+}
@@ -12,6 +12,7 @@
 
 #include "debug.h"
 #include "gpio.h"
+#include "settings.h"
 #include "tmr.h"
 
 /**
@@ -26,6 +27,7 @@ bresenham &xy_axes_init() {
         10     // turns_per_inch
     );
     x_axis.gpios.step = gpio{ 4, 8, SCU_MODE_FUNC4, 5, 12 }.init_output(); // DOUT4 P4_8    PIN15   GPIO5[12]
+    settings::read_compensation(x_axis.name, x_axis.compensation);
 
     static mot_pap y_axis(
         'Y',
@@ -34,6 +36,7 @@ bresenham &xy_axes_init() {
         10     // turns_per_inch
     );
     y_axis.gpios.step = gpio{ 4, 9, SCU_MODE_FUNC4, 5, 13 }.init_output(); // DOUT5 P4_9    PIN33   GPIO5[13]
+    settings::read_compensation(y_axis.name, y_axis.compensation);
 
     static tmr xy_axes_tmr = tmr(LPC_TIMER0, RGU_TIMER0_RST, CLK_MX_TIMER0, TIMER0_IRQn);
     alignas(bresenham) static char xy_axes_buf[sizeof(bresenham)];
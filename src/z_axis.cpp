@@ -12,6 +12,7 @@
 
 #include "debug.h"
 #include "gpio.h"
+#include "settings.h"
 #include "tmr.h"
 
 /**
@@ -28,6 +29,7 @@ bresenham &z_axis_init() {
     z_axis.reversed_direction = true;
     z_axis.reversed_encoder = true;
     z_axis.gpios.step = gpio{ 4, 10, SCU_MODE_FUNC4, 5, 14 }.init_output(); // DOUT6 P4_10   PIN35   GPIO5[14]
+    settings::read_compensation(z_axis.name, z_axis.compensation);
 
     static mot_pap dummy_axis(
         'D',
@@ -0,0 +1,81 @@
+/**
+ * @file    cmd_lookup_bench.cpp
+ * @brief   command name lookup on the host: the perfect hash dispatch of
+ *          tcp_server_command against the linear strcmp scan it replaced.
+ * @note    names is a copy of the cmds_table names, only their count and
+ *          lengths matter here. On target CMD_STATS reports the real lookup
+ *          cycles.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+
+#include "perfect_hash.h"
+
+#define CMD_HASH_SLOTS    128
+#define CMD_HASH_MAX_SEED 20000
+#define ROUNDS            1000000
+
+static constexpr const char *names[] = {
+    "PROTOCOL_VERSION", "CONTROL_ENABLE", "BRAKES_MODE", "TOUCH_PROBE", "STALL_CONTROL_SETTINGS",
+    "TOUCH_PROBE_SETTINGS", "AXES_HARD_STOP_ALL", "AXES_SOFT_STOP_ALL", "LOGS", "LOG_LEVEL", "AXES_SETTINGS",
+    "NETWORK_SETTINGS", "MEM_INFO", "TEMP_INFO", "SET_COORDS", "MOVE_JOYSTICK", "MOVE_CLOSED_LOOP", "MOVE_INCREMENTAL",
+    "READ_ENCODERS", "READ_LIMITS", "SCOPE", "AUTOTUNE", "COMPENSATION", "ENCODERS_SETTINGS", "SPI_STATS", "CONTROL",
+    "CMD_STATS", "UDP_TELEMETRY", "TELEMETRY_CONFIG",
+};
+
+static constexpr int names_count = sizeof(names) / sizeof(names[0]);
+
+static constexpr auto slots =
+    perfect_hash<CMD_HASH_SLOTS>::build([](int i) { return names[i]; }, names_count, CMD_HASH_MAX_SEED);
+static_assert(slots.seed != 0, "no perfect hash seed");
+
+static int hash_lookup(const char *cmd) {
+    int index = slots.find(cmd);
+    return (index >= 0 && !strcmp(cmd, names[index])) ? index : -1;
+}
+
+static int linear_lookup(const char *cmd) {
+    for (int i = 0; i < names_count; i++) {
+        if (!strcmp(cmd, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @returns nanoseconds per lookup of cmd
+ */
+static double measure(int (*lookup)(const char *), const char *cmd) {
+    char copy[32]; // Not the pointer in names[], as a received command wouldn't be
+    strncpy(copy, cmd, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    const char *volatile input = copy;
+
+    volatile int sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        sink = sink + lookup(input);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ROUNDS;
+}
+
+int main() {
+    for (int i = 0; i < names_count; i++) {
+        if (hash_lookup(names[i]) != i || linear_lookup(names[i]) != i) {
+            printf("lookup of %s failed\n", names[i]);
+            return 1;
+        }
+    }
+
+    printf("%d names, seed %u\n", names_count, slots.seed);
+    for (const char *cmd : { "PROTOCOL_VERSION", "MOVE_JOYSTICK", "TELEMETRY_CONFIG", "NOT_A_COMMAND" }) {
+        printf("%-18s hash %6.1f ns, linear %6.1f ns\n", cmd, measure(hash_lookup, cmd), measure(linear_lookup, cmd));
+    }
+    return 0;
+}
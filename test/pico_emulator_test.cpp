@@ -0,0 +1,172 @@
+/**
+ * @file    pico_emulator_test.cpp
+ * @brief   closed loop against the emulated encoders board: targets are
+ *          written and counters read with the same frames encoders_pico sends,
+ *          a proportional loop steps the plant until the target reached IRQ
+ *          rises and reading the limits with WRITE_MASK ACKs it.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "pico_emulator.h"
+#include "quadrature_encoder_constants.h"
+
+namespace qec = quadrature_encoder_constants;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                                                    \
+    do {                                                                                                                    \
+        if (!(condition)) {                                                                                                 \
+            printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition);                                                   \
+            failures++;                                                                                                     \
+        }                                                                                                                   \
+    } while (0)
+
+static uint8_t crc8(const uint8_t *data, int len) {
+    uint8_t crc = 0x00;
+    while (len--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? static_cast<uint8_t>((crc << 1) ^ 0x07) : static_cast<uint8_t>(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * @class   host_bus
+ * @brief   master side of one register access, framed the way encoders_pico
+ *          frames it in each of its modes.
+ */
+class host_bus {
+  public:
+    enum mode { SPLIT, BATCHED, FRAMED };
+
+    host_bus(pico_emulator &pico, enum mode mode) : pico(pico), mode(mode) {
+    }
+
+    bool write(uint8_t address, int32_t value) {
+        return access(address | qec::WRITE_MASK, value, nullptr);
+    }
+
+    bool read(uint8_t address, int32_t *value) {
+        return access(address, 0, value);
+    }
+
+    uint8_t corrupt = 0; //!< xored into the first data byte of the next framed request
+
+  private:
+    bool access(uint8_t address, int32_t data, int32_t *value) {
+        uint8_t tx[1 + 5 + 3] = {};
+        uint8_t rx[1 + 5 + 3] = {};
+        uint8_t *op = &tx[1];
+        op[0] = address;
+        for (int i = 0; i < 4; i++) {
+            op[1 + i] = static_cast<uint8_t>((static_cast<uint32_t>(data) >> (24 - 8 * i)) & 0xFF);
+        }
+
+        const uint8_t *answer = &rx[2];
+        switch (mode) {
+        case SPLIT:
+            pico.frame(op, nullptr, 1);
+            if (value) {
+                static const uint8_t dummy[4] = {};
+                pico.frame(dummy, &rx[2], 4);
+            } else {
+                pico.frame(&op[1], nullptr, 4);
+            }
+            break;
+        case BATCHED: pico.frame(op, &rx[1], 5); break;
+        case FRAMED:
+            tx[0] = ++seq;
+            tx[6] = crc8(tx, 6);
+            tx[2] ^= corrupt;
+            corrupt = 0;
+            pico.frame(tx, rx, sizeof(tx));
+            if (rx[7] != seq || crc8(&rx[1], 7) != rx[8]) {
+                return false;
+            }
+            break;
+        }
+
+        if (value) {
+            *value = static_cast<int32_t>(static_cast<uint32_t>(answer[0]) << 24 | static_cast<uint32_t>(answer[1]) << 16 |
+                                          static_cast<uint32_t>(answer[2]) << 8 | static_cast<uint32_t>(answer[3]));
+        }
+        return true;
+    }
+
+    pico_emulator &pico;
+    enum mode mode;
+    uint8_t seq = 0;
+};
+
+/**
+ * @brief   moves X to a target the way the supervisor does, reading the
+ *          counter back every cycle and stepping the plant one pulse at a time
+ */
+static void closed_loop(enum host_bus::mode mode) {
+    pico_emulator pico;
+    host_bus bus(pico, mode);
+    const int32_t target = -1234;
+
+    CHECK(bus.write(qec::TARGETS + 1, target));
+    CHECK(pico.target(0) == target);
+    CHECK(!pico.irq());
+
+    int cycles = 0;
+    for (; cycles < 1000 && !pico.irq(); cycles++) {
+        int32_t counter = 0;
+        CHECK(bus.read(qec::COUNTERS + 1, &counter));
+        int32_t error = target - counter;
+        int32_t steps = std::abs(error) / 4 + 1; // Proportional, at least one pulse
+        for (int i = 0; i < steps && !pico.irq(); i++) {
+            pico.move(0, error > 0 ? 1 : -1);
+        }
+    }
+    CHECK(cycles < 1000);
+    CHECK(pico.irq());
+
+    int32_t counter = 0;
+    CHECK(bus.read(qec::COUNTERS + 1, &counter));
+    CHECK(counter == target);
+
+    int32_t limits = 0;
+    CHECK(bus.read(qec::LIMITS | qec::WRITE_MASK, &limits)); // ACKs the IRQ
+    CHECK(((limits >> 16) & 0xFF) == (1 << 0));
+    CHECK(!pico.irq());
+}
+
+/**
+ * @brief   a request corrupted on the wire isn't applied and isn't answered
+ */
+static void framed_rejects_corruption() {
+    pico_emulator pico;
+    host_bus bus(pico, host_bus::FRAMED);
+
+    bus.corrupt = 0x10;
+    CHECK(!bus.write(qec::TARGETS + 2, 500));
+    CHECK(pico.target(1) == 0);
+    CHECK(pico.rejected_frames() == 1);
+
+    CHECK(bus.write(qec::TARGETS + 2, 500));
+    CHECK(pico.target(1) == 500);
+}
+
+int main() {
+    closed_loop(host_bus::SPLIT);
+    closed_loop(host_bus::BATCHED);
+    closed_loop(host_bus::FRAMED);
+    framed_rejects_corruption();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("pico_emulator_test passed\n");
+    return EXIT_SUCCESS;
+}